@@ -7,29 +7,37 @@
  */
 
 /* GLIBC begin */
-#define _GNU_SOURCE  /* for tdestroy */
-#include <search.h> /* tfind, tsearch */
+#define _GNU_SOURCE  /* for qsort_r, getdents64, statx */
+#define _FILE_OFFSET_BITS 64  /* for 64 bit off_t everywhere */
 /* GLIBC end */
 
-#include <sys/types.h>  /* for opendir, readdir, stat */
-#include <sys/stat.h> /* for stat */
-#include <dirent.h>  /* for opendir, readdir */
+#include <sys/types.h>  /* for fstatat */
+#include <sys/stat.h> /* for statx, fstatat, umask */
+#include <sys/sysmacros.h> /* for makedev */
+#include <dirent.h>  /* for getdents64, struct dirent64 */
 #include <errno.h> /* for errno */
 
-#include <string.h> /* for strlen, strcmp, memcpy */
-#include <stdlib.h> /* for malloc, NULL, qsort */
+#include <string.h> /* for strlen, strcmp, memcpy, memchr */
+#include <stdlib.h> /* for malloc, NULL, qsort_r, realpath */
+#include <stdint.h> /* for uint32_t, uint64_t */
+#include <limits.h> /* for UINT_MAX */
 #include <assert.h> /* for assert */
-#include <stdio.h> /* for printf, fprintf, sprintf */
-#include <unistd.h> /* for readlink */
-
-/* for readlink */
-#ifndef SSIZE_MAX
-# define SSIZE_MAX 1024
-#else
-# ifndef LONG_MAX
-#  define LONG_MAX 1024
-# endif
-#endif
+#include <stdio.h> /* for fprintf */
+#include <unistd.h> /* for readlinkat, write, isatty */
+#include <fcntl.h> /* for openat, O_DIRECTORY, O_NOATIME */
+#include <sys/resource.h> /* for getrlimit, setrlimit */
+#include <sys/mman.h> /* for mmap */
+#include <sys/syscall.h> /* for SYS_io_uring_setup, SYS_io_uring_enter */
+#include <linux/io_uring.h> /* for struct io_uring_params, struct io_uring_sqe */
+#include <getopt.h> /* for getopt_long */
+#include <pthread.h> /* for pthread_create, pthread_mutex_lock */
+#include <signal.h> /* for sigset_t, SIGUSR1 */
+#include <poll.h> /* for poll */
+#include <time.h> /* for time, clock_gettime */
+#include <sys/inotify.h> /* for inotify_init1, inotify_add_watch */
+#include <sys/signalfd.h> /* for signalfd */
+#include <sys/socket.h> /* for socket, accept4, send */
+#include <sys/un.h> /* for struct sockaddr_un */
 
 #define COLOR_RESET "\033[0m"
 #define COLOR_BOLD_BLUE "\033[1;34m"
@@ -40,448 +48,6631 @@ typedef int bool;
 const bool true = 1;
 const bool false = 0;
 
-typedef struct _ckdu_tree_entry {
-	/* File/dir/link name (without path!), no more than MAX_NAME+1 bytes in size */
-	char *name;
-
-	/* Subset of struct stat filled by stat() */
+typedef struct _ckdu_staged_entry {
+	/* Subset of struct statx, on its way into the tree */
 	dev_t device;
-	ino_t inode;
+	uint64_t inode;
 	off_t content_size;
 	mode_t mode;
+	nlink_t link_count;
+	int64_t mtime;  /* Nanoseconds since the epoch */
+	int64_t ctime;
 
-	struct _ckdu_tree_entry *sibling;
+	/* Name in the staging buffer */
+	size_t name_pos;
+	size_t name_len;  /* Including terminator */
 
-	union {
-		struct {
-			struct _ckdu_tree_entry *child;
-			off_t add_content_size;
-		} dir;
+	/* Opened ahead of time by the io_uring engine, or -1 */
+	int fd;
+} ckdu_staged_entry;
 
-		struct {
-			char *target;
-		} link;
-	} extra;
-} ckdu_tree_entry;
+enum ckdu_engine {
+	CKDU_ENGINE_SYNC,
+	CKDU_ENGINE_URING
+};
 
-char * strdup(const char *text) {
-	char const *source = text ? text : "NULL";
-	size_t len = strlen(source);
-	char *target = malloc(len + 1);
-	if (!target) {
-		errno = ENOMEM;
-		return NULL;
-	}
-	memcpy(target, source, len);
-	target[len] = '\0';
-	return target;
-}
+enum ckdu_format {
+	CKDU_FORMAT_TREE,  /* For humans */
+	CKDU_FORMAT_JSON,
+	CKDU_FORMAT_CSV,
+	CKDU_FORMAT_BIN  /* See present_bin */
+};
 
-char * malloc_path_join(const char *dirname, const char *basename) {
-	size_t const len_dirname = strlen(dirname);
-	size_t const len_basename = strlen(basename);
-	char * const target = malloc(len_dirname + 1 + len_basename + 1);
+enum ckdu_boring_mode {
+	CKDU_BORING_FULL,  /* Crawl like anything else, hide on output */
+	CKDU_BORING_SHALLOW,  /* Only add up the entries right inside */
+	CKDU_BORING_SKIP  /* Do not even open */
+};
 
-	if (!target) {
-		errno = ENOMEM;
-		return NULL;
-	}
+typedef struct _ckdu_options {
+	unsigned int jobs;
 
-	memcpy(target, dirname, len_dirname);
-	target[len_dirname] = '/';
-	memcpy(target + len_dirname + 1, basename, len_basename);
-	target[len_dirname + 1 + len_basename] = '\0';
+	/* How metadata requests reach the kernel */
+	enum ckdu_engine engine;
+	unsigned int queue_depth;
 
-	return target;
+	/* Report blocks allocated rather than apparent size */
+	bool allocated_size;
+
+	/* Let network file systems answer from cached attributes */
+	bool dont_sync;
+
+	/* Stat entries sorted by inode number rather than in directory order */
+	bool inode_order;
+
+	/* Deeper entries are counted, but never make it into
+	 * the tree, and are left out when presenting one */
+	unsigned int max_depth;
+
+	/* Files are counted, but only directories make it into the tree */
+	bool dirs_only;
+
+	/* Entries listed per directory, zero for all. Only
+	 * as many files make it into the tree in the first place. */
+	unsigned int max_entries;
+
+	/* Smaller entries only count towards the other entries. Files
+	 * below the absolute threshold never make it into the tree. */
+	off_t threshold;
+	double threshold_percent;
+
+	/* Instead of the tree, list this many of the biggest files
+	 * and directories. Files never make it into the tree then. */
+	unsigned int top;
+
+	/* Folders nobody wants to see the inside of */
+	enum ckdu_boring_mode boring_mode;
+	char const * const *boring_names;
+	size_t boring_name_count;
+
+	/* Escape sequences marking file types on output */
+	bool color;
+	enum ckdu_format format;
+
+	/* One line of JSON per entry while crawling, instead of a tree */
+	bool stream;
+
+	/* Keep the tree up to date after crawling, see run_daemon */
+	bool daemon;
+
+	/* Ask for modification and change times, only
+	 * needed by what compares against them later */
+	bool stamps;
+
+	bool print_stats;
+} ckdu_options;
+
+void handle_out_of_memory(void) {
+	fprintf(stderr, "Error ENOMEM(%i) occured: Out of memory.\n", ENOMEM);
+	exit(1);
 }
 
-char * malloc_humanize(off_t int_number) {
-	const char * const units[] = {NULL, "  B", "kiB", "MiB", "GiB", "TiB", "PiB", "EiB"};
-	off_t divisor = 1024;
-	unsigned int exponent = 1;
-	double float_number = int_number;
-	char * res;
+/* Entries are addressed by 32 bit index. Every column of the tree lives
+ * in chunks of CKDU_TREE_CHUNK_SIZE entries that never move, so crawler
+ * threads can keep reading while others append. Children of a directory
+ * occupy the index range [first_child, first_child + child_count). */
+#define CKDU_TREE_CHUNK_BITS 16
+#define CKDU_TREE_CHUNK_SIZE (1UL << CKDU_TREE_CHUNK_BITS)
+#define CKDU_TREE_MAX_CHUNKS (1UL << (32 - CKDU_TREE_CHUNK_BITS))
 
-	while (float_number > divisor) {
-		float_number /= divisor;
-		exponent++;
-	}
-	assert(exponent < sizeof(units) / sizeof(char *));
+/* Names are packed into chunks of bytes, handed out in blocks per thread */
+#define CKDU_NAMES_CHUNK_BITS 20
+#define CKDU_NAMES_CHUNK_SIZE (1UL << CKDU_NAMES_CHUNK_BITS)
+#define CKDU_NAMES_MAX_CHUNKS (1UL << 16)
+#define CKDU_NAMES_BLOCK_SIZE (1UL << 16)
+
+#define CKDU_NO_INDEX ((ckdu_index)-1)
+
+#define CKDU_AT(column, index) \
+	((column)[(index) >> CKDU_TREE_CHUNK_BITS][(index) & (CKDU_TREE_CHUNK_SIZE - 1)])
+
+typedef uint32_t ckdu_index;
 
-	/* Size = Pre-dot + dot + post-dot + unit + \0 */
-	res = malloc(4 + 1 + 1 + 3 + 1);
+typedef struct _ckdu_link_target {
+	ckdu_index index;  /* CKDU_NO_INDEX for free slots */
+	char *target;
+} ckdu_link_target;
+
+typedef struct _ckdu_tree {
+	uint64_t **name_offset;
+	off_t **content_size;  /* Own size */
+	off_t **total_size;  /* Own size plus everything counted below */
+	uint64_t **inode;
+	uint32_t **mode;
+	uint32_t **device;  /* Into devices */
+	ckdu_index **parent;
+	ckdu_index **first_child;
+	uint32_t **child_count;
+	int64_t **mtime;
+	int64_t **ctime;
+
+	/* Only with --dirs-only, about the files right inside a directory */
+	bool file_aggregates;
+	uint32_t **file_count;
+	off_t **file_size;
+	off_t **largest_file;
+
+	/* Only with --max-entries, about the files that did not make it */
+	bool other_buckets;
+	uint32_t **other_count;
+	off_t **other_size;
+
+	ckdu_index count;
+	unsigned long chunk_count;
+
+	char **names;
+	uint64_t names_len;  /* Handed out to threads in blocks, see tree_add_name */
+	unsigned long names_chunk_count;
+
+	dev_t *devices;
+	uint32_t device_count;
+	uint32_t device_capacity;
+
+	/* Directories with an entry right inside (or below --max-depth)
+	 * that is reachable elsewhere too: a file with more than one link,
+	 * or a directory seen before. Sorted once crawling is done, kept in
+	 * snapshots so that --since never takes any of them over. */
+	ckdu_index *shared_dirs;
+	uint32_t shared_dir_count;
+	uint32_t shared_dir_capacity;
+
+	/* Only for trees loaded from a snapshot, see load_snapshot */
+	void *mapping;
+	size_t mapping_len;
+	uint64_t **link_offset;  /* Into names, if a symlink */
+
+	/* Symlink targets are read when first asked for, relative to root_fd */
+	int root_fd;
+	ckdu_link_target *links;  /* Open addressing by index */
+	size_t link_count;
+	size_t link_capacity;
+
+	pthread_mutex_t lock;
+} ckdu_tree;
+
+typedef struct _ckdu_name_block {
+	uint64_t next;
+	uint64_t end;
+} ckdu_name_block;
+
+void * calloc_or_die(size_t count, size_t size) {
+	void * const res = calloc(count, size);
 	if (!res) {
-		errno = ENOMEM;
-		return NULL;
+		handle_out_of_memory();
 	}
-
-	sprintf(res, "%6.1f%s", float_number, units[exponent]);
 	return res;
 }
 
-bool is_symlink(ckdu_tree_entry const *entry) {
-	assert(entry);
-	return S_ISLNK(entry->mode);
+void * malloc_or_die(size_t size) {
+	void * const res = malloc(size);
+	if (!res) {
+		handle_out_of_memory();
+	}
+	return res;
 }
 
-bool is_executable_anybody(ckdu_tree_entry const *entry) {
-	assert(entry);
-	return (entry->mode & (S_IXUSR | S_IXGRP | S_IXOTH)) != 0;
-}
+void tree_init(ckdu_tree *tree, bool file_aggregates, bool other_buckets) {
+	tree->name_offset = calloc_or_die(CKDU_TREE_MAX_CHUNKS, sizeof(uint64_t *));
+	tree->content_size = calloc_or_die(CKDU_TREE_MAX_CHUNKS, sizeof(off_t *));
+	tree->total_size = calloc_or_die(CKDU_TREE_MAX_CHUNKS, sizeof(off_t *));
+	tree->inode = calloc_or_die(CKDU_TREE_MAX_CHUNKS, sizeof(uint64_t *));
+	tree->mode = calloc_or_die(CKDU_TREE_MAX_CHUNKS, sizeof(uint32_t *));
+	tree->device = calloc_or_die(CKDU_TREE_MAX_CHUNKS, sizeof(uint32_t *));
+	tree->parent = calloc_or_die(CKDU_TREE_MAX_CHUNKS, sizeof(ckdu_index *));
+	tree->first_child = calloc_or_die(CKDU_TREE_MAX_CHUNKS, sizeof(ckdu_index *));
+	tree->child_count = calloc_or_die(CKDU_TREE_MAX_CHUNKS, sizeof(uint32_t *));
+	tree->mtime = calloc_or_die(CKDU_TREE_MAX_CHUNKS, sizeof(int64_t *));
+	tree->ctime = calloc_or_die(CKDU_TREE_MAX_CHUNKS, sizeof(int64_t *));
+	tree->file_aggregates = file_aggregates;
+	if (file_aggregates) {
+		tree->file_count = calloc_or_die(CKDU_TREE_MAX_CHUNKS, sizeof(uint32_t *));
+		tree->file_size = calloc_or_die(CKDU_TREE_MAX_CHUNKS, sizeof(off_t *));
+		tree->largest_file = calloc_or_die(CKDU_TREE_MAX_CHUNKS, sizeof(off_t *));
+	} else {
+		tree->file_count = NULL;
+		tree->file_size = NULL;
+		tree->largest_file = NULL;
+	}
+	tree->other_buckets = other_buckets;
+	if (other_buckets) {
+		tree->other_count = calloc_or_die(CKDU_TREE_MAX_CHUNKS, sizeof(uint32_t *));
+		tree->other_size = calloc_or_die(CKDU_TREE_MAX_CHUNKS, sizeof(off_t *));
+	} else {
+		tree->other_count = NULL;
+		tree->other_size = NULL;
+	}
+	tree->count = 0;
+	tree->chunk_count = 0;
 
-bool is_nonlink_dir(ckdu_tree_entry const *entry) {
-	assert(entry);
-	return S_ISDIR(entry->mode);
-}
+	tree->names = calloc_or_die(CKDU_NAMES_MAX_CHUNKS, sizeof(char *));
+	tree->names_len = 0;
+	tree->names_chunk_count = 0;
 
-int initialize_tree_entry(ckdu_tree_entry *entry, const char *dirname, const char *basename) {
-	char * const path = malloc_path_join(dirname, basename);
-	struct stat props;
-	int res;
-	errno = 0;
-	
-	if (!path) {
-		errno = ENOMEM;
-		return -1;
-	}
+	tree->devices = NULL;
+	tree->device_count = 0;
+	tree->device_capacity = 0;
 
-	res = lstat(path, &props);
-	free(path);
+	tree->shared_dirs = NULL;
+	tree->shared_dir_count = 0;
+	tree->shared_dir_capacity = 0;
 
-	entry->device = props.st_dev;
-	entry->inode = props.st_ino;
-	entry->content_size = props.st_size;
-	entry->mode = props.st_mode;
+	tree->mapping = NULL;
+	tree->mapping_len = 0;
+	tree->link_offset = NULL;
 
-	entry->name = strdup(basename);
-	if (!entry->name) {
-		errno = ENOMEM;
-		return -1;
-	}
-	assert(entry->name);
+	tree->root_fd = -1;
+	tree->links = NULL;
+	tree->link_count = 0;
+	tree->link_capacity = 0;
 
-	entry->extra.dir.child = NULL;
-	entry->sibling = NULL;
-	entry->extra.dir.add_content_size = 0;
+	pthread_mutex_init(&tree->lock, NULL);
+}
 
-	if (is_symlink(entry)) {
-		ssize_t res2;
-		size_t term_pos;
-		entry->extra.link.target = malloc(SSIZE_MAX + 1);
-		if (!entry->extra.link.target) {
-			errno = ENOMEM;
-			return -1;
+void tree_release(ckdu_tree *tree) {
+	unsigned long i = 0;
+	if (tree->mapping) {
+		/* Chunks point into the mapping */
+		munmap(tree->mapping, tree->mapping_len);
+		tree->chunk_count = 0;
+		tree->names_chunk_count = 0;
+	}
+	for (; i < tree->chunk_count; i++) {
+		free(tree->name_offset[i]);
+		free(tree->content_size[i]);
+		free(tree->total_size[i]);
+		free(tree->inode[i]);
+		free(tree->mode[i]);
+		free(tree->device[i]);
+		free(tree->parent[i]);
+		free(tree->first_child[i]);
+		free(tree->child_count[i]);
+		free(tree->mtime[i]);
+		free(tree->ctime[i]);
+		if (tree->file_aggregates) {
+			free(tree->file_count[i]);
+			free(tree->file_size[i]);
+			free(tree->largest_file[i]);
+		}
+		if (tree->other_buckets) {
+			free(tree->other_count[i]);
+			free(tree->other_size[i]);
 		}
-		errno = 0;
-		res2 = readlink(path, entry->extra.link.target, SSIZE_MAX);
-		term_pos = (res2 == -1)
-			? SSIZE_MAX
-			: res2;
-		entry->extra.link.target[term_pos] = '\0';
-	} else {
-		entry->extra.link.target = NULL;
 	}
-
-	return res;
+	for (i = 0; i < tree->names_chunk_count; i++) {
+		free(tree->names[i]);
+	}
+	for (i = 0; i < tree->link_capacity; i++) {
+		free(tree->links[i].target);
+	}
+	free(tree->name_offset);
+	free(tree->content_size);
+	free(tree->total_size);
+	free(tree->inode);
+	free(tree->mode);
+	free(tree->device);
+	free(tree->parent);
+	free(tree->first_child);
+	free(tree->child_count);
+	free(tree->mtime);
+	free(tree->ctime);
+	free(tree->file_count);
+	free(tree->file_size);
+	free(tree->largest_file);
+	free(tree->other_count);
+	free(tree->other_size);
+	free(tree->link_offset);
+	free(tree->names);
+	free(tree->devices);
+	free(tree->shared_dirs);
+	free(tree->links);
+	pthread_mutex_destroy(&tree->lock);
 }
 
-void default_error(const char ** constant, const char ** description) {
-	*constant = "E???";
-	*description = "Unknown error";
-}
+ckdu_index tree_reserve(ckdu_tree *tree, uint32_t count) {
+	/* Hands out count consecutive indices */
+	ckdu_index first;
 
-void describe_opendir_error(int code, const char ** constant, const char ** description) {
-	/* http://opengroup.org/onlinepubs/007908799/xsh/opendir.html */
-	switch (code) {
-	case EACCES: *constant = "EACCES"; *description = "Search permission is denied for the component of the path prefix of dirname or read permission is denied for dirname."; return;
-	case ELOOP: *constant = "ELOOP"; *description = "Too many symbolic links were encountered in resolving path."; return;
-	case ENOENT: *constant = "ENOENT"; *description = "A component of dirname does not name an existing directory or dirname is an empty string."; return;
-	case ENOTDIR: *constant = "ENOTDIR"; *description = "A component of dirname is not a directory."; return;
-	case EMFILE: *constant = "EMFILE"; *description = "{OPEN_MAX} file descriptors are currently open in the calling process. "; return;
-	case ENAMETOOLONG: *constant = "ENAMETOOLONG"; *description = "Pathname resolution of a symbolic link produced an intermediate result whose length exceeds {PATH_MAX}."; return;
-	case ENFILE: *constant = "ENFILE"; *description = "Too many files are currently open in the system."; return;
-	default: default_error(constant, description); return;
+	pthread_mutex_lock(&tree->lock);
+	first = tree->count;
+	if ((uint64_t)first + count >= CKDU_NO_INDEX) {
+		fprintf(stderr, "Error: More than %lu entries are not supported.\n",
+				(unsigned long)CKDU_NO_INDEX - 1);
+		exit(1);
 	}
-	assert(false);
-}
+	tree->count += count;
 
-void describe_readdir_error(int code, const char ** constant, const char ** description) {
-	/* http://www.opengroup.org/onlinepubs/009695399/functions/readdir.html */
-	switch (code) {
-	case EOVERFLOW: *constant = "EOVERFLOW"; *description = "One of the values in the structure to be returned cannot be represented correctly."; return;
-	case EBADF: *constant = "EBADF"; *description = "The dirp argument does not refer to an open directory stream."; return;
-	case ENOENT: *constant = "ENOENT"; *description = "The current position of the directory stream is invalid."; return;
-	default: default_error(constant, description); return;
+	while (tree->chunk_count * CKDU_TREE_CHUNK_SIZE < tree->count) {
+		unsigned long const i = tree->chunk_count;
+		tree->name_offset[i] = malloc_or_die(CKDU_TREE_CHUNK_SIZE * sizeof(uint64_t));
+		tree->content_size[i] = malloc_or_die(CKDU_TREE_CHUNK_SIZE * sizeof(off_t));
+		tree->total_size[i] = malloc_or_die(CKDU_TREE_CHUNK_SIZE * sizeof(off_t));
+		tree->inode[i] = malloc_or_die(CKDU_TREE_CHUNK_SIZE * sizeof(uint64_t));
+		tree->mode[i] = malloc_or_die(CKDU_TREE_CHUNK_SIZE * sizeof(uint32_t));
+		tree->device[i] = malloc_or_die(CKDU_TREE_CHUNK_SIZE * sizeof(uint32_t));
+		tree->parent[i] = malloc_or_die(CKDU_TREE_CHUNK_SIZE * sizeof(ckdu_index));
+		tree->first_child[i] = malloc_or_die(CKDU_TREE_CHUNK_SIZE * sizeof(ckdu_index));
+		tree->child_count[i] = malloc_or_die(CKDU_TREE_CHUNK_SIZE * sizeof(uint32_t));
+		tree->mtime[i] = malloc_or_die(CKDU_TREE_CHUNK_SIZE * sizeof(int64_t));
+		tree->ctime[i] = malloc_or_die(CKDU_TREE_CHUNK_SIZE * sizeof(int64_t));
+		if (tree->file_aggregates) {
+			tree->file_count[i] = malloc_or_die(CKDU_TREE_CHUNK_SIZE * sizeof(uint32_t));
+			tree->file_size[i] = malloc_or_die(CKDU_TREE_CHUNK_SIZE * sizeof(off_t));
+			tree->largest_file[i] = malloc_or_die(CKDU_TREE_CHUNK_SIZE * sizeof(off_t));
+		}
+		if (tree->other_buckets) {
+			tree->other_count[i] = malloc_or_die(CKDU_TREE_CHUNK_SIZE * sizeof(uint32_t));
+			tree->other_size[i] = malloc_or_die(CKDU_TREE_CHUNK_SIZE * sizeof(off_t));
+		}
+		tree->chunk_count++;
 	}
-	assert(false);
+	pthread_mutex_unlock(&tree->lock);
+
+	return first;
 }
 
-void describe_stat_error(int code, const char ** constant, const char ** description) {
-	/* http://www.opengroup.org/onlinepubs/000095399/functions/stat.html */
-	switch (code) {
-	case EACCES: *constant = "EACCES"; *description = "Search permission is denied for a component of the path prefix."; return;
-	case EIO: *constant = "EIO"; *description = "An error occurred while reading from the file system."; return;
-	case ENOENT: *constant = "ENOENT"; *description = "A component of path does not name an existing file or path is an empty string."; return;
-	case ENOTDIR: *constant = "ENOTDIR"; *description = "A component of the path prefix is not a directory."; return;
-	case ELOOP: *constant = "ELOOP"; *description = "More than {SYMLOOP_MAX} symbolic links were encountered during resolution of the path argument."; return;
-	case ENAMETOOLONG: *constant = "ENAMETOOLONG"; *description = "As a result of encountering a symbolic link in resolution of the path argument, the length of the substituted pathname string exceeded {PATH_MAX}."; return;
-	case EOVERFLOW: *constant = "EOVERFLOW"; *description = "A value to be stored would overflow one of the members of the stat structure. "; return;
-	default: default_error(constant, description); return;
+uint64_t tree_add_name(ckdu_tree *tree, ckdu_name_block *block, const char *bytes, size_t len) {
+	/* Blocks never straddle chunks, and neither do names */
+	uint64_t offset;
+
+	assert(len <= CKDU_NAMES_BLOCK_SIZE);
+	if (block->next + len > block->end) {
+		pthread_mutex_lock(&tree->lock);
+		block->next = tree->names_len;
+		block->end = block->next + CKDU_NAMES_BLOCK_SIZE;
+		tree->names_len = block->end;
+		while (tree->names_chunk_count * CKDU_NAMES_CHUNK_SIZE < tree->names_len) {
+			if (tree->names_chunk_count == CKDU_NAMES_MAX_CHUNKS) {
+				handle_out_of_memory();
+			}
+			tree->names[tree->names_chunk_count++] = malloc_or_die(CKDU_NAMES_CHUNK_SIZE);
+		}
+		pthread_mutex_unlock(&tree->lock);
 	}
-	assert(false);
+
+	offset = block->next;
+	memcpy(tree->names[offset >> CKDU_NAMES_CHUNK_BITS] + (offset & (CKDU_NAMES_CHUNK_SIZE - 1)),
+			bytes, len);
+	block->next += len;
+	return offset;
 }
 
-void print_error(int code, const char * action, const char *dirname, const char *basename, const char * constant, const char * description) {
-	fprintf(stderr, "Error %s(%i) occured when %s \"%s/%s\": %s\n", constant, code, action, dirname, basename ? basename : "", description);
+char const * tree_name_at(ckdu_tree const *tree, uint64_t offset) {
+	return tree->names[offset >> CKDU_NAMES_CHUNK_BITS] + (offset & (CKDU_NAMES_CHUNK_SIZE - 1));
 }
 
-void handle_stat_error(int code, const char *dirname, const char *basename) {
-	const char * constant = NULL;
-	const char * description = NULL;
-	describe_stat_error(code, &constant, &description);
-	print_error(code, "statting", dirname, basename, constant, description);
+char const * tree_name(ckdu_tree const *tree, ckdu_index index) {
+	return tree_name_at(tree, CKDU_AT(tree->name_offset, index));
 }
 
-void handle_readdir_error(int code, const char *dirname) {
-	const char * constant = NULL;
-	const char * description = NULL;
-	describe_readdir_error(code, &constant, &description);
-	print_error(code, "reading", dirname, NULL, constant, description);
+ckdu_link_target * tree_find_link(ckdu_link_target *links, size_t capacity, ckdu_index index) {
+	/* Returns the slot of that entry, or the free slot it would go into */
+	size_t i = ((uint64_t)index * 0x9E3779B9UL) & (capacity - 1);
+	while ((links[i].index != CKDU_NO_INDEX) && (links[i].index != index)) {
+		i = (i + 1) & (capacity - 1);
+	}
+	return links + i;
 }
 
-void handle_opendir_error(int code, const char *dirname) {
-	const char * constant = NULL;
-	const char * description = NULL;
-	describe_opendir_error(code, &constant, &description);
-	print_error(code, "opening", dirname, NULL, constant, description);
+char const * tree_cached_link(ckdu_tree *tree, ckdu_index index) {
+	char const *target = NULL;
+
+	pthread_mutex_lock(&tree->lock);
+	if (tree->link_count) {
+		target = tree_find_link(tree->links, tree->link_capacity, index)->target;
+	}
+	pthread_mutex_unlock(&tree->lock);
+	return target;
 }
 
+char const * tree_cache_link(ckdu_tree *tree, ckdu_index index, char *target) {
+	/* Takes ownership of target, returns whatever ends up cached */
+	ckdu_link_target *slot;
 
+	pthread_mutex_lock(&tree->lock);
+	if (2 * (tree->link_count + 1) > tree->link_capacity) {
+		size_t const capacity = tree->link_capacity ? 2 * tree->link_capacity : 64;
+		ckdu_link_target * const links = malloc(capacity * sizeof(ckdu_link_target));
+		size_t i = 0;
 
-int compare_siblings(const void *void_a, const void *void_b) {
-	ckdu_tree_entry const * const a = *(ckdu_tree_entry const * const *)void_a;
-	ckdu_tree_entry const * const b = *(ckdu_tree_entry const * const *)void_b;
+		if (!links) {
+			handle_out_of_memory();
+		}
+		for (; i < capacity; i++) {
+			links[i].index = CKDU_NO_INDEX;
+			links[i].target = NULL;
+		}
+		for (i = 0; i < tree->link_capacity; i++) {
+			if (tree->links[i].index != CKDU_NO_INDEX) {
+				*tree_find_link(links, capacity, tree->links[i].index) = tree->links[i];
+			}
+		}
+		free(tree->links);
+		tree->links = links;
+		tree->link_capacity = capacity;
+	}
 
-	/* Meant to compare entries as following:
-	 * 1. Dirs before files
-	 * 2. Big things before small things, content-wise
-	 * 3. After that sort alphabetically
-	 */
-	int const diff_dir = is_nonlink_dir(b) - is_nonlink_dir(a);
-	if (diff_dir) {
-		return diff_dir;
+	slot = tree_find_link(tree->links, tree->link_capacity, index);
+	if (slot->index == CKDU_NO_INDEX) {
+		slot->index = index;
+		slot->target = target;
+		tree->link_count++;
 	} else {
-		int const diff_size = (b->content_size + b->extra.dir.add_content_size)
-				- (a->content_size + a->extra.dir.add_content_size);
-		if (diff_size) {
-			return diff_size;
-		} else {
-			return strcmp(a->name, b->name);
-		}
+		/* Somebody else was quicker */
+		free(target);
 	}
+	target = slot->target;
+	pthread_mutex_unlock(&tree->lock);
+
+	return target;
 }
 
-void sort_siblings(ckdu_tree_entry *parent, int child_count) {
-	ckdu_tree_entry ** const array = malloc(child_count * sizeof(ckdu_tree_entry *));
-	ckdu_tree_entry *read = parent->extra.dir.child;
-	ckdu_tree_entry *prev;
-	int i = 0;
+uint32_t tree_device_index(ckdu_tree *tree, dev_t device) {
+	/* Only a handful of devices in practice */
+	uint32_t i = 0;
 
-	if (!child_count) {
-		/* Empty list is always sorted */
-		return;
+	pthread_mutex_lock(&tree->lock);
+	for (; i < tree->device_count; i++) {
+		if (tree->devices[i] == device) {
+			break;
+		}
 	}
-
-	/* Fill array from linked list */
-	for (; i < child_count; i++) {
-		assert(read);
-		array[i] = read;
-		read = read->sibling;
+	if (i == tree->device_count) {
+		if (tree->device_count == tree->device_capacity) {
+			uint32_t const capacity = tree->device_capacity ? 2 * tree->device_capacity : 8;
+			dev_t * const devices = realloc(tree->devices, capacity * sizeof(dev_t));
+			if (!devices) {
+				handle_out_of_memory();
+			}
+			tree->devices = devices;
+			tree->device_capacity = capacity;
+		}
+		tree->devices[tree->device_count++] = device;
 	}
+	pthread_mutex_unlock(&tree->lock);
 
-	/* Sort array */
-	qsort(array, child_count, sizeof(ckdu_tree_entry *), compare_siblings);
+	return i;
+}
 
-	/* Re-create list from array */
-	parent->extra.dir.child = array[0];
-	prev = array[0];
-	for (i = 1; i < child_count; i++) {
-		prev->sibling = array[i];
-		prev = array[i];
+void tree_add_shared_dir(ckdu_tree *tree, ckdu_index dir) {
+	/* Duplicates go away in tree_sort_shared_dirs */
+	pthread_mutex_lock(&tree->lock);
+	if (tree->shared_dir_count == tree->shared_dir_capacity) {
+		uint32_t const capacity = tree->shared_dir_capacity ? 2 * tree->shared_dir_capacity : 64;
+		ckdu_index * const dirs = realloc(tree->shared_dirs, capacity * sizeof(ckdu_index));
+		if (!dirs) {
+			handle_out_of_memory();
+		}
+		tree->shared_dirs = dirs;
+		tree->shared_dir_capacity = capacity;
 	}
-	prev->sibling = NULL;
+	tree->shared_dirs[tree->shared_dir_count++] = dir;
+	pthread_mutex_unlock(&tree->lock);
+}
 
-	free(array);
+int compare_indices(const void *void_a, const void *void_b) {
+	ckdu_index const a = *(ckdu_index const *)void_a;
+	ckdu_index const b = *(ckdu_index const *)void_b;
+	return (a > b) - (a < b);
 }
 
-int compare_trees_id_wise(const void *void_a, const void *void_b) {
-	ckdu_tree_entry const * const a = (ckdu_tree_entry const *)void_a;
-	ckdu_tree_entry const * const b = (ckdu_tree_entry const *)void_b;
+void tree_sort_shared_dirs(ckdu_tree *tree) {
+	uint32_t count = 0;
+	uint32_t i = 0;
 
-	const int dev_diff = a->device - b->device;
-	if (dev_diff) {
-		return dev_diff;
-	} else {
-		return a->inode - b->inode;
+	if (!tree->shared_dir_count) {
+		return;
+	}
+	qsort(tree->shared_dirs, tree->shared_dir_count, sizeof(ckdu_index), compare_indices);
+	for (; i < tree->shared_dir_count; i++) {
+		if (!count || (tree->shared_dirs[i] != tree->shared_dirs[count - 1])) {
+			tree->shared_dirs[count++] = tree->shared_dirs[i];
+		}
 	}
+	tree->shared_dir_count = count;
 }
 
-bool add_to_pool(void **inode_pool, ckdu_tree_entry const *entry) {
-	ckdu_tree_entry const * const key = entry;
-	ckdu_tree_entry **value;
-
-	value = tfind(key, inode_pool, compare_trees_id_wise);
-	if (value) {
-		return false;
+void tree_set_entry(ckdu_tree *tree, ckdu_index index, ckdu_staged_entry const *entry,
+		uint64_t name_offset, uint32_t device_index, ckdu_index parent) {
+	CKDU_AT(tree->name_offset, index) = name_offset;
+	CKDU_AT(tree->content_size, index) = entry->content_size;
+	CKDU_AT(tree->total_size, index) = entry->content_size;
+	CKDU_AT(tree->inode, index) = entry->inode;
+	CKDU_AT(tree->mode, index) = entry->mode;
+	CKDU_AT(tree->device, index) = device_index;
+	CKDU_AT(tree->parent, index) = parent;
+	CKDU_AT(tree->first_child, index) = CKDU_NO_INDEX;
+	CKDU_AT(tree->child_count, index) = 0;
+	CKDU_AT(tree->mtime, index) = entry->mtime;
+	CKDU_AT(tree->ctime, index) = entry->ctime;
+	if (tree->file_aggregates) {
+		CKDU_AT(tree->file_count, index) = 0;
+		CKDU_AT(tree->file_size, index) = 0;
+		CKDU_AT(tree->largest_file, index) = 0;
 	}
-
-	value = tsearch(key, inode_pool, compare_trees_id_wise);
-	if (!value) {
-		/* Ran out of space, TODO */
-		assert(false);
+	if (tree->other_buckets) {
+		CKDU_AT(tree->other_count, index) = 0;
+		CKDU_AT(tree->other_size, index) = 0;
 	}
-	return true;
 }
 
-void crawl_tree(ckdu_tree_entry *virtual_root, void **inode_pool, const char *dirname) {
-	DIR * dir;
-	struct dirent *entry;
-	ckdu_tree_entry *prev = NULL;
-	int child_count = 0;
+ckdu_index plant_root(ckdu_tree *tree, ckdu_staged_entry const *entry) {
+	/* The starting point comes first, named "." */
+	ckdu_index const root = tree_reserve(tree, 1);
+	ckdu_name_block name;
 
-	errno = 0;
-	dir = opendir(dirname);
-	if (!dir) {
-		handle_opendir_error(errno, dirname);
-		return;
+	name.next = 0;
+	name.end = 0;
+	tree_set_entry(tree, root, entry, tree_add_name(tree, &name, ".", 2),
+			tree_device_index(tree, entry->device), CKDU_NO_INDEX);
+	return root;
+}
+
+#define CKDU_SIZE_DISPLAY_LEN 9
+
+char * format_size(char *target, off_t int_number) {
+	/* Fills in CKDU_SIZE_DISPLAY_LEN characters plus terminator, like
+	 * "%6.1f%s" of the size in units of 1024 would, with integers only */
+	const char * const units[] = {"  B", "kiB", "MiB", "GiB", "TiB", "PiB", "EiB"};
+	uint64_t const number = (uint64_t)int_number;
+	uint64_t unit = 1;
+	uint64_t tenths;
+	uint64_t rest;
+	unsigned int exponent = 0;
+	char *write = target + 6;
+
+	while ((number / unit > 1024) || ((number / unit == 1024) && (number % unit))) {
+		unit *= 1024;
+		exponent++;
+	}
+	assert(exponent < sizeof(units) / sizeof(char *));
+
+	/* Round half to even, like printf */
+	tenths = number / unit * 10 + number % unit * 10 / unit;
+	rest = number % unit * 10 % unit;
+	if ((rest > unit - rest) || ((rest == unit - rest) && (tenths & 1))) {
+		tenths++;
 	}
 
+	memcpy(target + 6, units[exponent], 4);
+	*--write = (char)('0' + tenths % 10);
+	*--write = '.';
+	tenths /= 10;
 	do {
-		errno = 0;
-		entry = readdir(dir);
-		if (!entry) {
-			if (errno) {
-				handle_opendir_error(errno, dirname);
-			}
-		} else {
-			if (strcmp(entry->d_name, ".") && strcmp(entry->d_name, "..")) {
-				ckdu_tree_entry * const node = malloc(sizeof(ckdu_tree_entry));
+		*--write = (char)('0' + tenths % 10);
+		tenths /= 10;
+	} while (tenths && (write > target));
+	while (write > target) {
+		*--write = ' ';
+	}
+	return target;
+}
 
-				errno = 0;
-				if (initialize_tree_entry(node, dirname, entry->d_name)) {
-					handle_stat_error(errno, dirname, entry->d_name);
-				} else {
-					if (prev) {
-						prev->sibling = node;
-					} else {
-						virtual_root->extra.dir.child = node;
-					}
-					prev = node;
-					child_count++;
+#define CKDU_OUTPUT_BUFFER_SIZE (1 << 18)
 
-					if (is_nonlink_dir(node)) {
-						char * const child_dirname = malloc_path_join(dirname, entry->d_name);
-						crawl_tree(node, inode_pool, child_dirname);
-						free(child_dirname);
-					}
+typedef struct _ckdu_output {
+	/* Lines pile up here and leave in few big write() calls */
+	int fd;
+	char *buffer;
+	size_t len;
+	size_t capacity;
 
-					if (add_to_pool(inode_pool, node)) {
-						/* Inode not seen in sister trees before */
-						virtual_root->extra.dir.add_content_size += node->content_size;
-						if (is_nonlink_dir(node)) {
-							virtual_root->extra.dir.add_content_size += node->extra.dir.add_content_size;
-						}
-					}
-				}
+	/* Grow rather than flush on a full buffer, so that whatever is
+	 * written next to the buffer's content stays in one piece */
+	bool growing;
+
+	/* Set when several threads share the file descriptor */
+	pthread_mutex_t *lock;
+
+	/* Escape sequences are noise unless a terminal is reading */
+	bool color;
+
+	/* Nothing but spaces, shared by all levels of indentation */
+	char *spaces;
+	size_t spaces_len;
+} ckdu_output;
+
+void output_init(ckdu_output *output, int fd, bool color) {
+	output->fd = fd;
+	output->buffer = malloc_or_die(CKDU_OUTPUT_BUFFER_SIZE);
+	output->len = 0;
+	output->capacity = CKDU_OUTPUT_BUFFER_SIZE;
+	output->growing = false;
+	output->lock = NULL;
+	output->color = color;
+	output->spaces = NULL;
+	output->spaces_len = 0;
+}
+
+void output_init_memory(ckdu_output *output, bool color) {
+	/* Collects everything, for writing out elsewhere */
+	output->fd = -1;
+	output->buffer = NULL;
+	output->len = 0;
+	output->capacity = 0;
+	output->growing = true;
+	output->lock = NULL;
+	output->color = color;
+	output->spaces = NULL;
+	output->spaces_len = 0;
+}
+
+void output_flush(ckdu_output *output) {
+	size_t done = 0;
+
+	if (output->lock) {
+		pthread_mutex_lock(output->lock);
+	}
+	while (done < output->len) {
+		ssize_t const res = write(output->fd, output->buffer + done, output->len - done);
+		if (res == -1) {
+			if (errno == EINTR) {
+				continue;
 			}
+			fprintf(stderr, "Error: Writing output failed (%s).\n", strerror(errno));
+			exit(1);
 		}
-	} while (entry);
+		done += (size_t)res;
+	}
+	if (output->lock) {
+		pthread_mutex_unlock(output->lock);
+	}
+	output->len = 0;
+}
+
+void output_release(ckdu_output *output) {
+	output_flush(output);
+	free(output->buffer);
+	free(output->spaces);
+}
 
-	sort_siblings(virtual_root, child_count);
+void output_bytes(ckdu_output *output, char const *bytes, size_t len) {
+	if (output->growing && (output->len + len > output->capacity)) {
+		size_t const capacity = 2 * (output->len + len);
+		char * const buffer = realloc(output->buffer, capacity);
+		if (!buffer) {
+			handle_out_of_memory();
+		}
+		output->buffer = buffer;
+		output->capacity = capacity;
+	}
+	while (len) {
+		size_t chunk = output->capacity - output->len;
+		if (!chunk) {
+			output_flush(output);
+			chunk = output->capacity;
+		}
+		if (chunk > len) {
+			chunk = len;
+		}
+		memcpy(output->buffer + output->len, bytes, chunk);
+		output->len += chunk;
+		bytes += chunk;
+		len -= chunk;
+	}
+}
 
-	closedir(dir);
+void output_string(ckdu_output *output, char const *text) {
+	output_bytes(output, text, strlen(text));
 }
 
-bool is_boring_folder(const char *basename) {
-	char const *blacklist[] = {"autom4te.cache", ".git", ".svn", "CVS"};
-	size_t i = 0;
-	for (; i < sizeof(blacklist) / sizeof(char *); i++) {
-		if (!strcmp(basename, blacklist[i])) {
-			return true;
+void output_color(ckdu_output *output, char const *sequence) {
+	if (output->color) {
+		output_string(output, sequence);
+	}
+}
+
+void output_unsigned(ckdu_output *output, uint64_t number) {
+	char digits[20];
+	char *write = digits + sizeof(digits);
+	do {
+		*--write = (char)('0' + number % 10);
+		number /= 10;
+	} while (number);
+	output_bytes(output, write, digits + sizeof(digits) - write);
+}
+
+void output_size(ckdu_output *output, off_t int_number) {
+	char size_display[CKDU_SIZE_DISPLAY_LEN + 1];
+	output_bytes(output, format_size(size_display, int_number), CKDU_SIZE_DISPLAY_LEN);
+}
+
+void output_trimmed_size(ckdu_output *output, off_t int_number) {
+	char size_display[CKDU_SIZE_DISPLAY_LEN + 1];
+	format_size(size_display, int_number);
+	output_string(output, size_display + strspn(size_display, " "));
+}
+
+void output_indent(ckdu_output *output, size_t len) {
+	if (len > output->spaces_len) {
+		size_t const spaces_len = 2 * len;
+		char * const spaces = realloc(output->spaces, spaces_len);
+		if (!spaces) {
+			handle_out_of_memory();
 		}
+		memset(spaces, ' ', spaces_len);
+		output->spaces = spaces;
+		output->spaces_len = spaces_len;
 	}
-	return false;
+	output_bytes(output, output->spaces, len);
 }
 
-void present_tree_indent(ckdu_tree_entry const *virtual_root, char const *indent) {
-	long const bytes_content = virtual_root->content_size + (is_nonlink_dir(virtual_root) ? virtual_root->extra.dir.add_content_size : 0);
-	ckdu_tree_entry const * child = virtual_root->extra.dir.child;
+void output_json_escaped(ckdu_output *output, char const *text) {
+	/* Bytes that are not UTF-8 come out as the Latin-1
+	 * character of the same number, to keep JSON valid */
+	char const hex[] = "0123456789abcdef";
+	unsigned char const *read = (unsigned char const *)text;
 
-	char const * const slash_or_not = is_nonlink_dir(virtual_root) ? "/" : "";
-	char * const size_display = malloc_humanize(bytes_content);
-	char const * const color_open = is_nonlink_dir(virtual_root)
-		? COLOR_BOLD_BLUE
-		: (is_symlink(virtual_root)
-			? COLOR_BOLD_CYAN
-			: (is_executable_anybody(virtual_root)
-				? COLOR_BOLD_GREEN
-				: ""));
-	char const * const color_close = COLOR_RESET;
-	printf("%9s%s %s%s%s%s%s%s\n", size_display, indent, color_open,
-		virtual_root->name, slash_or_not, color_close,
-			is_symlink(virtual_root)
-				? " -> "
-				: "",
-		   is_symlink(virtual_root)
-				? virtual_root->extra.link.target
-				: "");
-	free(size_display);
-
-	if (is_nonlink_dir(virtual_root) && child) {
-		size_t const child_indent_len = strlen(indent) + 2;
-		size_t i = 0;
-		char * const child_indent = malloc(child_indent_len + 1);
+	while (*read) {
+		size_t valid = 1;
 
-		/* Make indendation */
-		for (; i < child_indent_len; i++) {
-			child_indent[i] = ' ';
+		if (*read >= 0x80) {
+			size_t const len = (*read >= 0xf0) ? 4 : ((*read >= 0xe0) ? 3 : 2);
+			unsigned char const low = (*read == 0xe0) ? 0xa0 : ((*read == 0xf0) ? 0x90 : 0x80);
+			unsigned char const high = (*read == 0xed) ? 0x9f : ((*read == 0xf4) ? 0x8f : 0xbf);
+			size_t i = 1;
+
+			valid = ((*read >= 0xc2) && (*read <= 0xf4)) ? len : 0;
+			for (; valid && (i < len); i++) {
+				unsigned char const min = (i == 1) ? low : 0x80;
+				unsigned char const max = (i == 1) ? high : 0xbf;
+				if ((read[i] < min) || (read[i] > max)) {
+					valid = 0;
+				}
+			}
+		} else if ((*read < 0x20) || (*read == '"') || (*read == '\\')) {
+			valid = 0;
 		}
-		child_indent[child_indent_len] = '\0';
 
-		/* List children */
-		if (is_boring_folder(virtual_root->name)) {
-			printf("%9s%s %s\n", "...", child_indent, "...");
+		if (valid) {
+			output_bytes(output, (char const *)read, valid);
+			read += valid;
 		} else {
-			do {
-				present_tree_indent(child, child_indent);
-				child = child->sibling;
-			} while (child);
+			char escape[6] = {'\\', 'u', '0', '0', '0', '0'};
+			escape[4] = hex[*read >> 4];
+			escape[5] = hex[*read & 0xf];
+			output_bytes(output, escape, sizeof(escape));
+			read++;
 		}
-
-		free(child_indent);
 	}
 }
 
-void present_tree(ckdu_tree_entry const *virtual_root) {
-	present_tree_indent(virtual_root, "");
+void output_json_string(ckdu_output *output, char const *text) {
+	output_bytes(output, "\"", 1);
+	output_json_escaped(output, text);
+	output_bytes(output, "\"", 1);
 }
 
-void noop_free(void *key) {
-	key = key;
+void output_json_number(ckdu_output *output, char const *key, uint64_t number) {
+	output_bytes(output, ",\"", 2);
+	output_string(output, key);
+	output_bytes(output, "\":", 2);
+	output_unsigned(output, number);
 }
 
-int main(int argc, char **argv) {
-	ckdu_tree_entry pwd_entry;
-	void *inode_pool = NULL;
-	const char * const path = (argc > 1) ? argv[1] : ".";
+bool is_symlink(mode_t mode) {
+	return S_ISLNK(mode);
+}
 
-	if (initialize_tree_entry(&pwd_entry, path, ".")) {
-		handle_stat_error(errno, path, ".");
-		return 1;
+bool is_executable_anybody(mode_t mode) {
+	return (mode & (S_IXUSR | S_IXGRP | S_IXOTH)) != 0;
+}
+
+bool is_nonlink_dir(mode_t mode) {
+	return S_ISDIR(mode);
+}
+
+bool is_boring_folder(const char *basename, ckdu_options const *options) {
+	size_t i = 0;
+	for (; i < options->boring_name_count; i++) {
+		if (!strcmp(basename, options->boring_names[i])) {
+			return true;
+		}
 	}
-	crawl_tree(&pwd_entry, &inode_pool, path);
-	present_tree(&pwd_entry);
+	return false;
+}
 
-	tdestroy(inode_pool, noop_free);
+bool statx_unsupported = 0;
+
+unsigned int statx_mask(ckdu_options const *options) {
+	/* Ask for nothing we do not use, some file systems
+	 * need extra round trips for some of the fields */
+	return STATX_TYPE | STATX_MODE | STATX_INO | STATX_NLINK
+			| (options->stamps ? (STATX_MTIME | STATX_CTIME) : 0)
+			| (options->allocated_size ? STATX_BLOCKS : STATX_SIZE);
+}
+
+int statx_flags(ckdu_options const *options) {
+	return AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT
+			| (options->dont_sync ? AT_STATX_DONT_SYNC : AT_STATX_SYNC_AS_STAT);
+}
+
+void apply_statx(ckdu_staged_entry *entry, struct statx const *props, ckdu_options const *options) {
+	entry->device = makedev(props->stx_dev_major, props->stx_dev_minor);
+	entry->inode = props->stx_ino;
+	entry->content_size = options->allocated_size
+		? (off_t)props->stx_blocks * 512
+		: (off_t)props->stx_size;
+	entry->mode = props->stx_mode;
+	entry->link_count = props->stx_nlink;
+	entry->mtime = (int64_t)props->stx_mtime.tv_sec * 1000000000 + props->stx_mtime.tv_nsec;
+	entry->ctime = (int64_t)props->stx_ctime.tv_sec * 1000000000 + props->stx_ctime.tv_nsec;
+}
+
+int fetch_metadata(ckdu_staged_entry *entry, int dir_fd, const char *basename, ckdu_options const *options) {
+	if (!statx_unsupported) {
+		struct statx props;
+		if (!statx(dir_fd, basename, statx_flags(options), statx_mask(options), &props)) {
+			apply_statx(entry, &props, options);
+			return 0;
+		} else if (errno != ENOSYS) {
+			return -1;
+		}
+
+		/* Kernel too old, no need to ask again */
+		statx_unsupported = true;
+	}
+
+	{
+		struct stat props;
+		if (fstatat(dir_fd, basename, &props, AT_SYMLINK_NOFOLLOW)) {
+			return -1;
+		}
+		entry->device = props.st_dev;
+		entry->inode = props.st_ino;
+		entry->content_size = options->allocated_size
+			? (off_t)props.st_blocks * 512
+			: props.st_size;
+		entry->mode = props.st_mode;
+		entry->link_count = props.st_nlink;
+		entry->mtime = (int64_t)props.st_mtim.tv_sec * 1000000000 + props.st_mtim.tv_nsec;
+		entry->ctime = (int64_t)props.st_ctim.tv_sec * 1000000000 + props.st_ctim.tv_nsec;
+		return 0;
+	}
+}
+
+int open_directory_at(int dir_fd, const char *basename) {
+	int const flags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC;
+	int fd = openat(dir_fd, basename, flags | O_NOATIME);
+	if ((fd == -1) && (errno == EPERM)) {
+		/* O_NOATIME is reserved to the owner */
+		fd = openat(dir_fd, basename, flags);
+	}
+	return fd;
+}
+
+char * malloc_tree_path(const char *root_dirname, ckdu_tree const *tree, ckdu_index index) {
+	/* Only needed for messages, crawling itself works on file descriptors */
+	ckdu_index up = index;
+	size_t len = strlen(root_dirname);
+	char *target;
+	char *write;
+
+	for (; CKDU_AT(tree->parent, up) != CKDU_NO_INDEX; up = CKDU_AT(tree->parent, up)) {
+		len += 1 + strlen(tree_name(tree, up));
+	}
+
+	target = malloc(len + 1);
+	if (!target) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	write = target + len;
+	*write = '\0';
+	for (up = index; CKDU_AT(tree->parent, up) != CKDU_NO_INDEX; up = CKDU_AT(tree->parent, up)) {
+		char const * const name = tree_name(tree, up);
+		size_t const len_name = strlen(name);
+		write -= len_name;
+		memcpy(write, name, len_name);
+		*--write = '/';
+	}
+	memcpy(target, root_dirname, write - target);
+
+	return target;
+}
+
+int open_parent_directory(ckdu_tree const *tree, ckdu_index index) {
+	/* Descends from the root one directory at a time,
+	 * for paths too long to be handed over in one piece */
+	ckdu_index * path = NULL;
+	size_t depth = 0;
+	size_t capacity = 0;
+	ckdu_index up = CKDU_AT(tree->parent, index);
+	int fd;
+
+	for (; CKDU_AT(tree->parent, up) != CKDU_NO_INDEX; up = CKDU_AT(tree->parent, up)) {
+		if (depth == capacity) {
+			size_t const new_capacity = capacity ? 2 * capacity : 64;
+			ckdu_index * const new_path = realloc(path, new_capacity * sizeof(ckdu_index));
+			if (!new_path) {
+				handle_out_of_memory();
+			}
+			path = new_path;
+			capacity = new_capacity;
+		}
+		path[depth++] = up;
+	}
+
+	fd = fcntl(tree->root_fd, F_DUPFD_CLOEXEC, 0);
+	while ((fd != -1) && depth) {
+		int const next = open_directory_at(fd, tree_name(tree, path[--depth]));
+		close(fd);
+		fd = next;
+	}
+
+	free(path);
+	return fd;
+}
+
+char * malloc_link_target(ckdu_tree const *tree, ckdu_index index) {
+	/* The size of a symlink is the length of its target, mostly.
+	 * Some file systems and --allocated say otherwise, so grow as needed. */
+	size_t size = CKDU_AT(tree->content_size, index) + 1;
+	char * const path = malloc_tree_path(".", tree, index);
+	char *target = NULL;
+	ssize_t res;
+
+	if (!path) {
+		handle_out_of_memory();
+	}
+	if (size < 64) {
+		size = 64;
+	}
+
+	for (;;) {
+		char * const new_target = realloc(target, size);
+		if (!new_target) {
+			handle_out_of_memory();
+		}
+		target = new_target;
+
+		res = readlinkat(tree->root_fd, path, target, size);
+		if ((res == -1) && (errno == ENAMETOOLONG)) {
+			int const dir_fd = open_parent_directory(tree, index);
+			res = (dir_fd == -1)
+				? -1
+				: readlinkat(dir_fd, tree_name(tree, index), target, size);
+			if (dir_fd != -1) {
+				close(dir_fd);
+			}
+		}
+
+		if ((res == -1) || ((size_t)res < size)) {
+			break;
+		}
+		size *= 2;
+	}
+
+	target[(res == -1) ? 0 : res] = '\0';
+	free(path);
+	return target;
+}
+
+char const * tree_link_target(ckdu_tree *tree, ckdu_index index) {
+	char const *target;
+	if (tree->link_offset) {
+		return tree_name_at(tree, CKDU_AT(tree->link_offset, index));
+	}
+	target = tree_cached_link(tree, index);
+	if (target) {
+		return target;
+	}
+	return tree_cache_link(tree, index, malloc_link_target(tree, index));
+}
+
+/* Snapshots of a tree, for --save and --load. Header first, then
+ * sections at offsets listed in the header, each CKDU_SNAPSHOT_ALIGN
+ * aligned. All numbers are in the byte order of the machine saving,
+ * which the header tells. Columns are stored without gaps, in index
+ * order, so every chunk of a loaded column can point right into the
+ * mapped file. So can every chunk of names: names are packed such that
+ * none straddles a boundary of CKDU_NAMES_CHUNK_SIZE bytes. */
+#define CKDU_SNAPSHOT_MAGIC "CKDUSNAP"
+#define CKDU_SNAPSHOT_VERSION 2
+#define CKDU_SNAPSHOT_BYTE_ORDER 0x01020304UL
+#define CKDU_SNAPSHOT_ALIGN 64
+
+/* Offsets of names and link targets, then what tree_columns lists,
+ * which never has file aggregates and other buckets at once */
+#define CKDU_SNAPSHOT_MAX_COLUMNS 16
+
+enum ckdu_snapshot_section {
+	CKDU_SECTION_ROOT_PATH,
+	CKDU_SECTION_DEVICES,
+	CKDU_SECTION_NAMES,
+	CKDU_SECTION_SHARED_DIRS,
+	CKDU_SECTION_COLUMNS,  /* One section per column from here */
+	CKDU_SECTION_COUNT = CKDU_SECTION_COLUMNS + CKDU_SNAPSHOT_MAX_COLUMNS
+};
+
+typedef struct _ckdu_snapshot_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t entry_count;
+	uint32_t root;
+	uint32_t device_count;
+	uint32_t file_aggregates;
+	uint32_t other_buckets;
+	uint32_t shared_dir_count;
+	uint64_t settings;  /* See hash_tree_settings */
+	uint64_t names_len;
+	uint64_t sections[CKDU_SECTION_COUNT];
+} ckdu_snapshot_header;
+
+typedef struct _ckdu_column {
+	void **chunks;
+	size_t width;
+} ckdu_column;
+
+uint64_t hash_bytes(uint64_t hash, void const *bytes, size_t len) {
+	/* FNV-1a */
+	uint64_t const prime = ((uint64_t)0x100UL << 32) | 0x1B3UL;
+	unsigned char const *read = (unsigned char const *)bytes;
+	size_t i = 0;
+
+	for (; i < len; i++) {
+		hash = (hash ^ read[i]) * prime;
+	}
+	return hash;
+}
+
+uint64_t hash_tree_settings(ckdu_options const *options) {
+	/* Covers the options deciding what a tree holds and how sizes
+	 * add up, so that --since can tell a snapshot that fits */
+	uint64_t hash = ((uint64_t)0xCBF29CE4UL << 32) | 0x84222325UL;
+	unsigned int const other_buckets = (options->threshold_percent != 0.0);
+	unsigned int const boring_mode = options->boring_mode;
+	size_t i = 0;
+
+	hash = hash_bytes(hash, &options->allocated_size, sizeof(options->allocated_size));
+	hash = hash_bytes(hash, &options->max_depth, sizeof(options->max_depth));
+	hash = hash_bytes(hash, &options->dirs_only, sizeof(options->dirs_only));
+	hash = hash_bytes(hash, &options->max_entries, sizeof(options->max_entries));
+	hash = hash_bytes(hash, &options->threshold, sizeof(options->threshold));
+	hash = hash_bytes(hash, &other_buckets, sizeof(other_buckets));
+	hash = hash_bytes(hash, &boring_mode, sizeof(boring_mode));
+	if (options->boring_mode != CKDU_BORING_FULL) {
+		for (; i < options->boring_name_count; i++) {
+			hash = hash_bytes(hash, options->boring_names[i], strlen(options->boring_names[i]) + 1);
+		}
+	}
+	return hash;
+}
+
+size_t tree_columns(ckdu_tree const *tree, ckdu_column *columns) {
+	/* Everything but names and link targets, in snapshot order */
+	size_t count = 0;
+
+#define CKDU_ADD_COLUMN(column) \
+	columns[count].chunks = (void **)(column); \
+	columns[count].width = sizeof(**(column)); \
+	count++;
+
+	CKDU_ADD_COLUMN(tree->content_size)
+	CKDU_ADD_COLUMN(tree->total_size)
+	CKDU_ADD_COLUMN(tree->inode)
+	CKDU_ADD_COLUMN(tree->mode)
+	CKDU_ADD_COLUMN(tree->device)
+	CKDU_ADD_COLUMN(tree->parent)
+	CKDU_ADD_COLUMN(tree->first_child)
+	CKDU_ADD_COLUMN(tree->child_count)
+	CKDU_ADD_COLUMN(tree->mtime)
+	CKDU_ADD_COLUMN(tree->ctime)
+	if (tree->file_aggregates) {
+		CKDU_ADD_COLUMN(tree->file_count)
+		CKDU_ADD_COLUMN(tree->file_size)
+		CKDU_ADD_COLUMN(tree->largest_file)
+	}
+	if (tree->other_buckets) {
+		CKDU_ADD_COLUMN(tree->other_count)
+		CKDU_ADD_COLUMN(tree->other_size)
+	}
+
+#undef CKDU_ADD_COLUMN
+	return count;
+}
+
+uint64_t snapshot_place_name(uint64_t *names_len, size_t len) {
+	/* Moves on to the next chunk rather than straddling */
+	uint64_t const used = *names_len & (CKDU_NAMES_CHUNK_SIZE - 1);
+	uint64_t offset;
+
+	if (used + len > CKDU_NAMES_CHUNK_SIZE) {
+		*names_len += CKDU_NAMES_CHUNK_SIZE - used;
+	}
+	offset = *names_len;
+	*names_len += len;
+	return offset;
+}
+
+void snapshot_pad(ckdu_output *output, uint64_t *written, uint64_t until) {
+	static char const zeros[CKDU_SNAPSHOT_ALIGN] = {0};
+	while (*written < until) {
+		size_t const len = (until - *written > sizeof(zeros)) ? sizeof(zeros) : (size_t)(until - *written);
+		output_bytes(output, zeros, len);
+		*written += len;
+	}
+}
+
+void snapshot_section(ckdu_snapshot_header *header, uint64_t *end, int section, uint64_t len) {
+	header->sections[section] = (*end + CKDU_SNAPSHOT_ALIGN - 1) & ~(uint64_t)(CKDU_SNAPSHOT_ALIGN - 1);
+	*end = header->sections[section] + len;
+}
+
+void snapshot_names(ckdu_output *output, ckdu_tree *tree, uint64_t *written, int what) {
+	/* Walks the names in snapshot order, writing the offsets of
+	 * entry names (0), of link targets (1) or the names themselves (2) */
+	uint64_t const base = *written;
+	uint64_t names_len = 0;
+	ckdu_index i = 0;
+
+	for (; i < tree->count; i++) {
+		char const * const name = tree_name(tree, i);
+		size_t const name_len = strlen(name) + 1;
+		uint64_t offset = snapshot_place_name(&names_len, name_len);
+		uint64_t link_offset = (uint64_t)-1;
+
+		if (what == 2) {
+			snapshot_pad(output, written, base + offset);
+			output_bytes(output, name, name_len);
+			*written += name_len;
+		}
+		if (is_symlink(CKDU_AT(tree->mode, i))) {
+			char const * const target = tree_link_target(tree, i);
+			size_t const target_len = strlen(target) + 1;
+			link_offset = snapshot_place_name(&names_len, target_len);
+			if (what == 2) {
+				snapshot_pad(output, written, base + link_offset);
+				output_bytes(output, target, target_len);
+				*written += target_len;
+			}
+		}
+
+		if (what == 1) {
+			offset = link_offset;
+		}
+		if (what != 2) {
+			output_bytes(output, (char const *)&offset, sizeof(offset));
+			*written += sizeof(offset);
+		}
+	}
+}
+
+int save_snapshot(ckdu_tree *tree, ckdu_index root, char const *root_path,
+		uint64_t settings, char const *filename) {
+	ckdu_snapshot_header header;
+	ckdu_column columns[CKDU_SNAPSHOT_MAX_COLUMNS];
+	size_t const column_count = tree_columns(tree, columns);
+	uint64_t names_len = 0;
+	uint64_t end = sizeof(header);
+	uint64_t written = 0;
+	ckdu_output output;
+	ckdu_index i = 0;
+	size_t k = 0;
+	int fd;
+
+	/* Names go elsewhere than in memory, figure out where first */
+	for (; i < tree->count; i++) {
+		snapshot_place_name(&names_len, strlen(tree_name(tree, i)) + 1);
+		if (is_symlink(CKDU_AT(tree->mode, i))) {
+			snapshot_place_name(&names_len, strlen(tree_link_target(tree, i)) + 1);
+		}
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CKDU_SNAPSHOT_MAGIC, sizeof(header.magic));
+	header.version = CKDU_SNAPSHOT_VERSION;
+	header.byte_order = CKDU_SNAPSHOT_BYTE_ORDER;
+	header.entry_count = tree->count;
+	header.root = root;
+	header.device_count = tree->device_count;
+	header.file_aggregates = tree->file_aggregates;
+	header.other_buckets = tree->other_buckets;
+	header.shared_dir_count = tree->shared_dir_count;
+	header.settings = settings;
+	header.names_len = names_len;
+	snapshot_section(&header, &end, CKDU_SECTION_ROOT_PATH, strlen(root_path) + 1);
+	snapshot_section(&header, &end, CKDU_SECTION_DEVICES, (uint64_t)tree->device_count * sizeof(uint64_t));
+	snapshot_section(&header, &end, CKDU_SECTION_NAMES, names_len);
+	snapshot_section(&header, &end, CKDU_SECTION_SHARED_DIRS, (uint64_t)tree->shared_dir_count * sizeof(ckdu_index));
+	snapshot_section(&header, &end, CKDU_SECTION_COLUMNS, (uint64_t)tree->count * sizeof(uint64_t));
+	snapshot_section(&header, &end, CKDU_SECTION_COLUMNS + 1, (uint64_t)tree->count * sizeof(uint64_t));
+	for (k = 0; k < column_count; k++) {
+		snapshot_section(&header, &end, CKDU_SECTION_COLUMNS + 2 + (int)k, (uint64_t)tree->count * columns[k].width);
+	}
+
+	fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fd == -1) {
+		return -1;
+	}
+	output_init(&output, fd, false);
+
+	output_bytes(&output, (char const *)&header, sizeof(header));
+	written = sizeof(header);
+
+	snapshot_pad(&output, &written, header.sections[CKDU_SECTION_ROOT_PATH]);
+	output_bytes(&output, root_path, strlen(root_path) + 1);
+	written += strlen(root_path) + 1;
+
+	snapshot_pad(&output, &written, header.sections[CKDU_SECTION_DEVICES]);
+	for (k = 0; k < tree->device_count; k++) {
+		uint64_t const device = tree->devices[k];
+		output_bytes(&output, (char const *)&device, sizeof(device));
+		written += sizeof(device);
+	}
+
+	snapshot_pad(&output, &written, header.sections[CKDU_SECTION_NAMES]);
+	snapshot_names(&output, tree, &written, 2);
+	snapshot_pad(&output, &written, header.sections[CKDU_SECTION_SHARED_DIRS]);
+	if (tree->shared_dir_count) {
+		output_bytes(&output, (char const *)tree->shared_dirs, tree->shared_dir_count * sizeof(ckdu_index));
+		written += tree->shared_dir_count * sizeof(ckdu_index);
+	}
+	snapshot_pad(&output, &written, header.sections[CKDU_SECTION_COLUMNS]);
+	snapshot_names(&output, tree, &written, 0);
+	snapshot_pad(&output, &written, header.sections[CKDU_SECTION_COLUMNS + 1]);
+	snapshot_names(&output, tree, &written, 1);
+
+	for (k = 0; k < column_count; k++) {
+		snapshot_pad(&output, &written, header.sections[CKDU_SECTION_COLUMNS + 2 + k]);
+		for (i = 0; i < tree->count; i += CKDU_TREE_CHUNK_SIZE) {
+			size_t const entries = (tree->count - i < CKDU_TREE_CHUNK_SIZE) ? tree->count - i : CKDU_TREE_CHUNK_SIZE;
+			output_bytes(&output, (char const *)columns[k].chunks[i >> CKDU_TREE_CHUNK_BITS],
+					entries * columns[k].width);
+			written += entries * columns[k].width;
+		}
+	}
+
+	output_release(&output);
+	return close(fd);
+}
+
+bool is_sound_tree(ckdu_tree const *tree) {
+	/* Every entry gets looked at once, so that nothing read from a
+	 * snapshot points outside of it. Children come after their parent
+	 * and point back at it, which also rules out cycles. */
+	ckdu_index i = 0;
+
+	if (!tree->names_len || tree_name_at(tree, tree->names_len - 1)[0]) {
+		return false;
+	}
+	for (; i < tree->shared_dir_count; i++) {
+		if ((tree->shared_dirs[i] >= tree->count)
+				|| (i && (tree->shared_dirs[i] <= tree->shared_dirs[i - 1]))) {
+			return false;
+		}
+	}
+	for (i = 0; i < tree->count; i++) {
+		ckdu_index const parent = CKDU_AT(tree->parent, i);
+		ckdu_index const first = CKDU_AT(tree->first_child, i);
+		uint32_t const child_count = CKDU_AT(tree->child_count, i);
+		uint32_t k = 0;
+
+		if ((CKDU_AT(tree->name_offset, i) >= tree->names_len)
+				|| (is_symlink(CKDU_AT(tree->mode, i)) && (CKDU_AT(tree->link_offset, i) >= tree->names_len))
+				|| (CKDU_AT(tree->device, i) >= tree->device_count)
+				|| ((parent != CKDU_NO_INDEX) && (parent >= tree->count))) {
+			return false;
+		}
+		if (!child_count) {
+			continue;
+		}
+		if ((first <= i) || ((uint64_t)first + child_count > tree->count)) {
+			return false;
+		}
+		for (; k < child_count; k++) {
+			if (CKDU_AT(tree->parent, first + k) != i) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+int load_snapshot(ckdu_tree *tree, char const *filename, ckdu_index *root, char const **root_path,
+		uint64_t *settings) {
+	/* Nothing is parsed or copied, the tree points into the mapping.
+	 * Returns -1 with errno set and no tree to release, errno
+	 * being EINVAL for files that do not fit. */
+	ckdu_snapshot_header const *header;
+	ckdu_column columns[CKDU_SNAPSHOT_MAX_COLUMNS];
+	size_t column_count;
+	struct stat props;
+	uint64_t end = sizeof(ckdu_snapshot_header);
+	char *base;
+	size_t k;
+	unsigned long i;
+	int const fd = open(filename, O_RDONLY | O_CLOEXEC);
+
+	if (fd == -1) {
+		return -1;
+	}
+	if (fstat(fd, &props)) {
+		close(fd);
+		return -1;
+	}
+	if ((size_t)props.st_size < sizeof(ckdu_snapshot_header)) {
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+	base = mmap(NULL, props.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		return -1;
+	}
+
+	header = (ckdu_snapshot_header const *)base;
+	tree_init(tree, header->file_aggregates != 0, header->other_buckets != 0);
+	tree->mapping = base;
+	tree->mapping_len = props.st_size;
+	if (memcmp(header->magic, CKDU_SNAPSHOT_MAGIC, sizeof(header->magic))
+			|| (header->version != CKDU_SNAPSHOT_VERSION)
+			|| (header->byte_order != CKDU_SNAPSHOT_BYTE_ORDER)
+			|| (header->file_aggregates > 1) || (header->other_buckets > 1)
+			|| (header->file_aggregates && header->other_buckets)
+			|| (header->root >= header->entry_count)
+			|| (header->names_len > CKDU_NAMES_MAX_CHUNKS * CKDU_NAMES_CHUNK_SIZE)) {
+		tree_release(tree);
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* Sections follow the header and each other in the order
+	 * save_snapshot writes them, without overlapping */
+	column_count = tree_columns(tree, columns);
+	for (k = 0; k < CKDU_SECTION_COLUMNS + 2 + column_count; k++) {
+		size_t const width = (k < CKDU_SECTION_COLUMNS + 2)
+			? sizeof(uint64_t)
+			: columns[k - CKDU_SECTION_COLUMNS - 2].width;
+		uint64_t const len = (k == CKDU_SECTION_ROOT_PATH)
+			? 1
+			: (k == CKDU_SECTION_DEVICES)
+			? (uint64_t)header->device_count * width
+			: (k == CKDU_SECTION_NAMES)
+			? header->names_len
+			: (k == CKDU_SECTION_SHARED_DIRS)
+			? (uint64_t)header->shared_dir_count * sizeof(ckdu_index)
+			: (uint64_t)header->entry_count * width;
+		if ((header->sections[k] % CKDU_SNAPSHOT_ALIGN)
+				|| (header->sections[k] < end)
+				|| (header->sections[k] > (uint64_t)props.st_size)
+				|| (len > (uint64_t)props.st_size - header->sections[k])) {
+			tree_release(tree);
+			errno = EINVAL;
+			return -1;
+		}
+		end = header->sections[k] + len;
+	}
+	if (!memchr(base + header->sections[CKDU_SECTION_ROOT_PATH], '\0',
+			header->sections[CKDU_SECTION_DEVICES] - header->sections[CKDU_SECTION_ROOT_PATH])) {
+		tree_release(tree);
+		errno = EINVAL;
+		return -1;
+	}
+
+	tree->count = header->entry_count;
+	tree->chunk_count = (tree->count + CKDU_TREE_CHUNK_SIZE - 1) >> CKDU_TREE_CHUNK_BITS;
+	tree->names_len = header->names_len;
+	tree->names_chunk_count = (tree->names_len + CKDU_NAMES_CHUNK_SIZE - 1) >> CKDU_NAMES_CHUNK_BITS;
+	tree->link_offset = calloc_or_die(CKDU_TREE_MAX_CHUNKS, sizeof(uint64_t *));
+	for (i = 0; i < tree->names_chunk_count; i++) {
+		tree->names[i] = base + header->sections[CKDU_SECTION_NAMES] + i * CKDU_NAMES_CHUNK_SIZE;
+	}
+	for (i = 0; i < tree->chunk_count; i++) {
+		size_t const first = i * CKDU_TREE_CHUNK_SIZE;
+		tree->name_offset[i] = (uint64_t *)(base + header->sections[CKDU_SECTION_COLUMNS])
+				+ first;
+		tree->link_offset[i] = (uint64_t *)(base + header->sections[CKDU_SECTION_COLUMNS + 1])
+				+ first;
+		for (k = 0; k < column_count; k++) {
+			columns[k].chunks[i] = base + header->sections[CKDU_SECTION_COLUMNS + 2 + k]
+					+ first * columns[k].width;
+		}
+	}
+
+	tree->devices = malloc_or_die((header->device_count + 1) * sizeof(dev_t));
+	for (i = 0; i < header->device_count; i++) {
+		tree->devices[i] = (dev_t)((uint64_t const *)(base + header->sections[CKDU_SECTION_DEVICES]))[i];
+	}
+	tree->device_count = header->device_count;
+	tree->device_capacity = header->device_count + 1;
+
+	/* Copied, tree_release frees it as for any other tree */
+	tree->shared_dirs = malloc_or_die((header->shared_dir_count + 1) * sizeof(ckdu_index));
+	memcpy(tree->shared_dirs, base + header->sections[CKDU_SECTION_SHARED_DIRS],
+			header->shared_dir_count * sizeof(ckdu_index));
+	tree->shared_dir_count = header->shared_dir_count;
+	tree->shared_dir_capacity = header->shared_dir_count + 1;
+	if (!is_sound_tree(tree)) {
+		tree_release(tree);
+		errno = EINVAL;
+		return -1;
+	}
+
+	*root = header->root;
+	*root_path = base + header->sections[CKDU_SECTION_ROOT_PATH];
+	*settings = header->settings;
+	return 0;
+}
+
+void default_error(const char ** constant, const char ** description) {
+	*constant = "E???";
+	*description = "Unknown error";
+}
+
+void describe_opendir_error(int code, const char ** constant, const char ** description) {
+	/* http://opengroup.org/onlinepubs/007908799/xsh/opendir.html */
+	switch (code) {
+	case EACCES: *constant = "EACCES"; *description = "Search permission is denied for the component of the path prefix of dirname or read permission is denied for dirname."; return;
+	case ELOOP: *constant = "ELOOP"; *description = "Too many symbolic links were encountered in resolving path."; return;
+	case ENOENT: *constant = "ENOENT"; *description = "A component of dirname does not name an existing directory or dirname is an empty string."; return;
+	case ENOTDIR: *constant = "ENOTDIR"; *description = "A component of dirname is not a directory."; return;
+	case EMFILE: *constant = "EMFILE"; *description = "{OPEN_MAX} file descriptors are currently open in the calling process. "; return;
+	case ENAMETOOLONG: *constant = "ENAMETOOLONG"; *description = "Pathname resolution of a symbolic link produced an intermediate result whose length exceeds {PATH_MAX}."; return;
+	case ENFILE: *constant = "ENFILE"; *description = "Too many files are currently open in the system."; return;
+	default: default_error(constant, description); return;
+	}
+	assert(false);
+}
+
+void describe_readdir_error(int code, const char ** constant, const char ** description) {
+	/* http://www.opengroup.org/onlinepubs/009695399/functions/readdir.html */
+	switch (code) {
+	case EOVERFLOW: *constant = "EOVERFLOW"; *description = "One of the values in the structure to be returned cannot be represented correctly."; return;
+	case EBADF: *constant = "EBADF"; *description = "The dirp argument does not refer to an open directory stream."; return;
+	case ENOENT: *constant = "ENOENT"; *description = "The current position of the directory stream is invalid."; return;
+	case EINVAL: *constant = "EINVAL"; *description = "The buffer is too small to hold the next directory entry."; return;
+	case ENOTDIR: *constant = "ENOTDIR"; *description = "The file descriptor does not refer to a directory."; return;
+	default: default_error(constant, description); return;
+	}
+	assert(false);
+}
+
+void describe_stat_error(int code, const char ** constant, const char ** description) {
+	/* http://www.opengroup.org/onlinepubs/000095399/functions/stat.html */
+	switch (code) {
+	case EACCES: *constant = "EACCES"; *description = "Search permission is denied for a component of the path prefix."; return;
+	case EIO: *constant = "EIO"; *description = "An error occurred while reading from the file system."; return;
+	case ENOENT: *constant = "ENOENT"; *description = "A component of path does not name an existing file or path is an empty string."; return;
+	case ENOTDIR: *constant = "ENOTDIR"; *description = "A component of the path prefix is not a directory."; return;
+	case ELOOP: *constant = "ELOOP"; *description = "More than {SYMLOOP_MAX} symbolic links were encountered during resolution of the path argument."; return;
+	case ENAMETOOLONG: *constant = "ENAMETOOLONG"; *description = "As a result of encountering a symbolic link in resolution of the path argument, the length of the substituted pathname string exceeded {PATH_MAX}."; return;
+	case EOVERFLOW: *constant = "EOVERFLOW"; *description = "A value to be stored would overflow one of the members of the stat structure. "; return;
+	default: default_error(constant, description); return;
+	}
+	assert(false);
+}
+
+void print_error(int code, const char * action, const char *dirname, const char *basename, const char * constant, const char * description) {
+	fprintf(stderr, "Error %s(%i) occured when %s \"%s/%s\": %s\n", constant, code, action, dirname, basename ? basename : "", description);
+}
+
+void handle_stat_error(int code, const char *dirname, const char *basename) {
+	const char * constant = NULL;
+	const char * description = NULL;
+	describe_stat_error(code, &constant, &description);
+	print_error(code, "statting", dirname, basename, constant, description);
+}
+
+void handle_readdir_error(int code, const char *dirname) {
+	const char * constant = NULL;
+	const char * description = NULL;
+	describe_readdir_error(code, &constant, &description);
+	print_error(code, "reading", dirname, NULL, constant, description);
+}
+
+void handle_opendir_error(int code, const char *dirname) {
+	const char * constant = NULL;
+	const char * description = NULL;
+	describe_opendir_error(code, &constant, &description);
+	print_error(code, "opening", dirname, NULL, constant, description);
+}
+
+int compare_children(const void *void_a, const void *void_b, void *void_tree) {
+	ckdu_index const a = *(ckdu_index const *)void_a;
+	ckdu_index const b = *(ckdu_index const *)void_b;
+	ckdu_tree const * const tree = (ckdu_tree const *)void_tree;
+
+	/* Meant to compare entries as following:
+	 * 1. Dirs before files
+	 * 2. Big things before small things, content-wise
+	 * 3. After that sort alphabetically
+	 */
+	int const diff_dir = is_nonlink_dir(CKDU_AT(tree->mode, b)) - is_nonlink_dir(CKDU_AT(tree->mode, a));
+	if (diff_dir) {
+		return diff_dir;
+	} else {
+		off_t const size_a = CKDU_AT(tree->total_size, a);
+		off_t const size_b = CKDU_AT(tree->total_size, b);
+		if (size_a != size_b) {
+			return (size_a < size_b) ? 1 : -1;
+		} else {
+			return strcmp(tree_name(tree, a), tree_name(tree, b));
+		}
+	}
+}
+
+void sift_down(ckdu_index *heap, size_t count, size_t pos,
+		int (*compare)(const void *, const void *, void *), void *context) {
+	/* Max-heap, the item sorting last is on top */
+	for (;;) {
+		size_t const left = 2 * pos + 1;
+		size_t const right = left + 1;
+		size_t largest = pos;
+		ckdu_index swap;
+
+		if ((left < count) && (compare(heap + left, heap + largest, context) > 0)) {
+			largest = left;
+		}
+		if ((right < count) && (compare(heap + right, heap + largest, context) > 0)) {
+			largest = right;
+		}
+		if (largest == pos) {
+			return;
+		}
+		swap = heap[pos];
+		heap[pos] = heap[largest];
+		heap[largest] = swap;
+		pos = largest;
+	}
+}
+
+size_t select_first(ckdu_index *items, size_t count, size_t limit,
+		int (*compare)(const void *, const void *, void *), void *context) {
+	/* Moves the limit items sorting first to the front, sorted, and
+	 * returns how many that are. The rest is left behind in any order.
+	 * O(n log limit) rather than sorting everything. */
+	size_t i;
+
+	if (limit >= count) {
+		qsort_r(items, count, sizeof(ckdu_index), compare, context);
+		return count;
+	}
+
+	for (i = limit / 2; i-- > 0;) {
+		sift_down(items, limit, i, compare, context);
+	}
+	for (i = limit; i < count; i++) {
+		if (limit && (compare(items + i, items, context) < 0)) {
+			ckdu_index const swap = items[0];
+			items[0] = items[i];
+			items[i] = swap;
+			sift_down(items, limit, 0, compare, context);
+		}
+	}
+
+	qsort_r(items, limit, sizeof(ckdu_index), compare, context);
+	return limit;
+}
+
+ckdu_index * malloc_sorted_children(ckdu_tree const *tree, ckdu_index parent,
+		size_t limit, off_t min_size, size_t *shown) {
+	/* Children stay where they are in the tree, sizes may still
+	 * change after crawling so order is only decided for output.
+	 * Children smaller than min_size are moved behind the others. */
+	ckdu_index const first = CKDU_AT(tree->first_child, parent);
+	uint32_t const child_count = CKDU_AT(tree->child_count, parent);
+	ckdu_index * const array = malloc((child_count + 1) * sizeof(ckdu_index));
+	size_t big_count = 0;
+	size_t small_pos = child_count;
+	uint32_t i = 0;
+
+	if (!array) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	for (; i < child_count; i++) {
+		if (CKDU_AT(tree->total_size, first + i) >= min_size) {
+			array[big_count++] = first + i;
+		} else {
+			array[--small_pos] = first + i;
+		}
+	}
+	*shown = select_first(array, big_count, limit, compare_children, (void *)tree);
+	return array;
+}
+
+typedef struct _ckdu_inode_slot {
+	dev_t device;
+	uint64_t inode;
+	off_t content_size;
+
+	/* Path-wise first link found so far, CKDU_NO_INDEX for free slots */
+	ckdu_index first;
+
+	/* First link is below --max-depth, first is the directory it is in */
+	bool folded;
+
+	/* First link sits right inside first, among the files counted
+	 * for --dirs-only there, see aggregate_files */
+	bool listed;
+
+	/* Has more than one link, content is counted after crawling */
+	bool shared;
+} ckdu_inode_slot;
+
+typedef struct _ckdu_inode_set {
+	/* Open addressing with linear probing, only directories
+	 * and files with more than one link ever get in here */
+	ckdu_inode_slot *slots;
+	size_t capacity;  /* Power of two */
+	size_t count;
+} ckdu_inode_set;
+
+void inode_set_init(ckdu_inode_set *set) {
+	set->slots = NULL;
+	set->capacity = 0;
+	set->count = 0;
+}
+
+void inode_set_release(ckdu_inode_set *set) {
+	free(set->slots);
+	inode_set_init(set);
+}
+
+size_t hash_inode(dev_t device, uint64_t inode) {
+	/* Inode numbers are often dense, so spread them out */
+	uint64_t const golden = ((uint64_t)0x9E3779B9UL << 32) | 0x7F4A7C15UL;
+	uint64_t const hash = (inode ^ ((uint64_t)device << 24) ^ ((uint64_t)device >> 40)) * golden;
+	return (size_t)(hash ^ (hash >> 29));
+}
+
+ckdu_inode_slot * inode_set_probe(ckdu_inode_slot *slots, size_t capacity, dev_t device, uint64_t inode) {
+	/* Returns the slot of that inode, or the free slot it would go into */
+	size_t i = hash_inode(device, inode) & (capacity - 1);
+	for (;;) {
+		ckdu_inode_slot * const slot = slots + i;
+		if ((slot->first == CKDU_NO_INDEX)
+				|| ((slot->inode == inode) && (slot->device == device))) {
+			return slot;
+		}
+		i = (i + 1) & (capacity - 1);
+	}
+}
+
+void inode_set_grow(ckdu_inode_set *set) {
+	size_t const capacity = set->capacity ? 2 * set->capacity : 1024;
+	ckdu_inode_slot * const slots = malloc(capacity * sizeof(ckdu_inode_slot));
+	size_t i = 0;
+
+	if (!slots) {
+		handle_out_of_memory();
+	}
+	for (; i < capacity; i++) {
+		slots[i].first = CKDU_NO_INDEX;
+	}
+	for (i = 0; i < set->capacity; i++) {
+		ckdu_inode_slot const * const old = set->slots + i;
+		if (old->first != CKDU_NO_INDEX) {
+			*inode_set_probe(slots, capacity, old->device, old->inode) = *old;
+		}
+	}
+
+	free(set->slots);
+	set->slots = slots;
+	set->capacity = capacity;
+}
+
+ckdu_inode_slot * inode_set_insert(ckdu_inode_set *set, dev_t device, uint64_t inode, ckdu_index first, bool *inserted) {
+	/* Finds the slot of that inode, taking a new one if needed.
+	 * Slots move when the set grows, so do not hold on to them. */
+	ckdu_inode_slot *slot;
+
+	if (2 * (set->count + 1) > set->capacity) {
+		inode_set_grow(set);
+	}
+
+	slot = inode_set_probe(set->slots, set->capacity, device, inode);
+	*inserted = (slot->first == CKDU_NO_INDEX);
+	if (*inserted) {
+		slot->device = device;
+		slot->inode = inode;
+		slot->content_size = 0;
+		slot->first = first;
+		slot->folded = false;
+		slot->listed = false;
+		slot->shared = false;
+		set->count++;
+	}
+	return slot;
+}
+
+void inode_set_remove(ckdu_inode_set *set, ckdu_inode_slot *slot) {
+	/* Moves later slots of the same run up into the gap
+	 * wherever probing would no longer get to them */
+	size_t const mask = set->capacity - 1;
+	size_t gap = (size_t)(slot - set->slots);
+	size_t i = gap;
+
+	for (;;) {
+		ckdu_inode_slot const *next;
+		size_t home;
+
+		i = (i + 1) & mask;
+		next = set->slots + i;
+		if (next->first == CKDU_NO_INDEX) {
+			break;
+		}
+		home = hash_inode(next->device, next->inode) & mask;
+		if ((gap <= i) ? ((gap < home) && (home <= i)) : ((gap < home) || (home <= i))) {
+			continue;
+		}
+		set->slots[gap] = *next;
+		gap = i;
+	}
+	set->slots[gap].first = CKDU_NO_INDEX;
+	set->count--;
+}
+
+int compare_trees_path_wise(ckdu_tree const *tree, ckdu_index a, ckdu_index b) {
+	/* Orders entries by their path, component by component, so that
+	 * picking the "first" of several hardlinks does not depend on the
+	 * order in which crawler threads happened to find them */
+	ckdu_index a_up = a;
+	ckdu_index b_up = b;
+	int a_depth = 0;
+	int b_depth = 0;
+
+	if (a == b) {
+		return 0;
+	}
+
+	for (; CKDU_AT(tree->parent, a_up) != CKDU_NO_INDEX; a_up = CKDU_AT(tree->parent, a_up)) {
+		a_depth++;
+	}
+	for (; CKDU_AT(tree->parent, b_up) != CKDU_NO_INDEX; b_up = CKDU_AT(tree->parent, b_up)) {
+		b_depth++;
+	}
+
+	a_up = a;
+	b_up = b;
+	for (; a_depth > b_depth; a_depth--) {
+		a_up = CKDU_AT(tree->parent, a_up);
+	}
+	for (; b_depth > a_depth; b_depth--) {
+		b_up = CKDU_AT(tree->parent, b_up);
+	}
+
+	if (a_up == b_up) {
+		/* One is an ancestor of the other */
+		return (a == a_up) ? -1 : 1;
+	}
+
+	while (CKDU_AT(tree->parent, a_up) != CKDU_AT(tree->parent, b_up)) {
+		a_up = CKDU_AT(tree->parent, a_up);
+		b_up = CKDU_AT(tree->parent, b_up);
+	}
+	return strcmp(tree_name(tree, a_up), tree_name(tree, b_up));
+}
+
+typedef struct _ckdu_top_file {
+	off_t content_size;
+	ckdu_index dir;
+	char const *name;
+} ckdu_top_file;
+
+typedef struct _ckdu_top_files {
+	/* Bounded heap of the biggest files seen so far with the smallest
+	 * on top, so that most files are turned down by a single compare */
+	ckdu_tree const *tree;
+	ckdu_top_file *files;
+	ckdu_index *heap;
+	size_t count;
+	size_t limit;
+} ckdu_top_files;
+
+void top_files_init(ckdu_top_files *top, ckdu_tree const *tree, size_t limit) {
+	top->tree = tree;
+	top->files = malloc_or_die((limit + 1) * sizeof(ckdu_top_file));
+	top->heap = malloc_or_die((limit + 1) * sizeof(ckdu_index));
+	top->count = 0;
+	top->limit = limit;
+}
+
+void top_files_release(ckdu_top_files *top) {
+	size_t i = 0;
+	for (; i < top->count; i++) {
+		free((void *)top->files[i].name);
+	}
+	free(top->files);
+	free(top->heap);
+}
+
+int compare_top_files(const void *void_a, const void *void_b, void *void_top) {
+	/* Bigger first, ties broken by path so that
+	 * the pick does not depend on thread timing */
+	ckdu_top_files const * const top = (ckdu_top_files const *)void_top;
+	ckdu_top_file const * const a = top->files + *(ckdu_index const *)void_a;
+	ckdu_top_file const * const b = top->files + *(ckdu_index const *)void_b;
+
+	if (a->content_size != b->content_size) {
+		return (a->content_size < b->content_size) ? 1 : -1;
+	}
+	if (a->dir != b->dir) {
+		return compare_trees_path_wise(top->tree, a->dir, b->dir);
+	}
+	return strcmp(a->name, b->name);
+}
+
+void top_files_offer(ckdu_top_files *top, ckdu_index dir, off_t content_size, char const *name) {
+	ckdu_index const candidate = top->limit;
+	ckdu_top_file *file;
+	size_t len;
+
+	if (top->count == top->limit) {
+		/* The spare slot behind the heap holds the candidate */
+		if (!top->limit || (content_size < top->files[top->heap[0]].content_size)) {
+			return;
+		}
+		top->files[candidate].content_size = content_size;
+		top->files[candidate].dir = dir;
+		top->files[candidate].name = name;
+		if (compare_top_files(&candidate, top->heap, top) >= 0) {
+			return;
+		}
+		file = top->files + top->heap[0];
+		free((void *)file->name);
+	} else {
+		file = top->files + top->count;
+		top->heap[top->count] = top->count;
+		top->count++;
+	}
+
+	len = strlen(name) + 1;
+	file->content_size = content_size;
+	file->dir = dir;
+	file->name = memcpy(malloc_or_die(len), name, len);
+
+	if (top->count < top->limit) {
+		return;
+	} else if (file == top->files + top->heap[0]) {
+		sift_down(top->heap, top->count, 0, compare_top_files, top);
+	} else {
+		/* Just filled up */
+		size_t i = top->count / 2;
+		while (i-- > 0) {
+			sift_down(top->heap, top->count, i, compare_top_files, top);
+		}
+	}
+}
+
+typedef struct _ckdu_uring {
+	int fd;
+
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_array;
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+	unsigned int sqe_tail;  /* Prepared, maybe not yet submitted */
+	struct io_uring_sqe *sqes;
+
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+} ckdu_uring;
+
+int uring_setup(ckdu_uring *ring, unsigned int entries) {
+	/* Raw system calls, so that liburing is not needed */
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+
+	ring->fd = syscall(SYS_io_uring_setup, entries, &params);
+	if (ring->fd == -1) {
+		return -1;
+	}
+
+	ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size) {
+			ring->sq_ring_size = ring->cq_ring_size;
+		}
+		ring->cq_ring_size = 0;
+	}
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	ring->cq_ring = ring->cq_ring_size
+		? mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING)
+		: ring->sq_ring;
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if ((ring->sq_ring == MAP_FAILED) || (ring->cq_ring == MAP_FAILED)
+			|| (ring->sqes == MAP_FAILED)) {
+		int const code = errno;
+		if (ring->sq_ring != MAP_FAILED) {
+			munmap(ring->sq_ring, ring->sq_ring_size);
+		}
+		if (ring->cq_ring_size && (ring->cq_ring != MAP_FAILED)) {
+			munmap(ring->cq_ring, ring->cq_ring_size);
+		}
+		if (ring->sqes != MAP_FAILED) {
+			munmap(ring->sqes, ring->sqes_size);
+		}
+		close(ring->fd);
+		errno = code;
+		return -1;
+	}
+
+	ring->sq_head = (unsigned int *)((char *)ring->sq_ring + params.sq_off.head);
+	ring->sq_tail = (unsigned int *)((char *)ring->sq_ring + params.sq_off.tail);
+	ring->sq_array = (unsigned int *)((char *)ring->sq_ring + params.sq_off.array);
+	ring->sq_mask = *(unsigned int *)((char *)ring->sq_ring + params.sq_off.ring_mask);
+	ring->sq_entries = params.sq_entries;
+	ring->sqe_tail = *ring->sq_tail;
+
+	ring->cq_head = (unsigned int *)((char *)ring->cq_ring + params.cq_off.head);
+	ring->cq_tail = (unsigned int *)((char *)ring->cq_ring + params.cq_off.tail);
+	ring->cq_mask = *(unsigned int *)((char *)ring->cq_ring + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring + params.cq_off.cqes);
+
+	return 0;
+}
+
+void uring_teardown(ckdu_uring *ring) {
+	munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring_size) {
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	}
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+}
+
+struct io_uring_sqe * uring_get_sqe(ckdu_uring *ring) {
+	unsigned int const head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	unsigned int index;
+	struct io_uring_sqe *sqe;
+
+	if (ring->sqe_tail - head >= ring->sq_entries) {
+		return NULL;
+	}
+
+	index = ring->sqe_tail & ring->sq_mask;
+	sqe = ring->sqes + index;
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	ring->sq_array[index] = index;
+	ring->sqe_tail++;
+	return sqe;
+}
+
+int uring_submit_and_wait(ckdu_uring *ring, unsigned int wait_nr) {
+	unsigned int const to_submit = ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	int res;
+
+	__atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+	do {
+		res = syscall(SYS_io_uring_enter, ring->fd, to_submit, wait_nr,
+				wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while ((res == -1) && (errno == EINTR));
+	return res;
+}
+
+struct io_uring_cqe * uring_peek_cqe(ckdu_uring *ring) {
+	unsigned int const head = *ring->cq_head;
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+		return NULL;
+	}
+	return ring->cqes + (head & ring->cq_mask);
+}
+
+void uring_cqe_seen(ckdu_uring *ring) {
+	__atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+typedef struct _ckdu_crawl_job {
+	/* Directories below --max-depth are not in the tree, they
+	 * carry their own name and add up into their closest ancestor */
+	ckdu_index node;
+	char *name;  /* NULL if node is the directory itself */
+	unsigned int depth;
+
+	struct _ckdu_crawl_job *parent;
+
+	/* Opened ahead of time by the parent's scan, or -1 */
+	int fd;
+
+	/* Kept open until all child directories have been opened relative to it */
+	int dir_fd;
+
+	/* The scan itself plus child jobs that have not opened their directory yet */
+	long dir_users;
+
+	/* Child jobs not finished yet, plus one while scanning */
+	long pending;
+
+	/* Boring folder, add up its entries but do not keep or enter them */
+	bool shallow;
+
+	/* The same directory in the snapshot given to --since, if any */
+	ckdu_index previous;
+
+	/* Still has the stamps it had in the snapshot, so subdirectories
+	 * that do too are taken over from there rather than crawled */
+	bool unchanged;
+
+	/* For --stream, which has no tree to add up in. The
+	 * content is complete once nothing is pending anymore. */
+	off_t own_size;
+	off_t content_below;
+} ckdu_crawl_job;
+
+typedef struct _ckdu_deque {
+	pthread_mutex_t lock;
+	ckdu_crawl_job **jobs;
+	size_t head;  /* Thieves take from here */
+	size_t tail;  /* The owner pushes and pops here */
+	size_t capacity;
+} ckdu_deque;
+
+typedef struct _ckdu_crawler {
+	ckdu_deque *deques;
+	unsigned int worker_count;
+
+	ckdu_tree *tree;
+	const char *root_dirname;
+	int root_fd;
+	ckdu_options const *options;
+
+	/* Snapshot given to --since, or NULL */
+	ckdu_tree const *previous;
+
+	/* Only with --since, per entry of the snapshot. Directories with
+	 * one of its shared_dirs somewhere below are never taken over, what
+	 * is reachable elsewhere too could be counted twice otherwise. */
+	bool *shared_below;
+
+	/* Directories that may be held open ahead of their scan */
+	long preopen_budget;
+
+	ckdu_inode_set *inode_set;
+	pthread_mutex_t pool_lock;
+
+	/* Taken around writes with --stream */
+	pthread_mutex_t stream_lock;
+
+	pthread_mutex_t idle_lock;
+	pthread_cond_t idle_cond;
+	long queued;  /* Jobs sitting in deques */
+	long outstanding;  /* Jobs queued or being scanned */
+	unsigned int sleeping;
+} ckdu_crawler;
+
+/* Big enough for thousands of entries per system call */
+#define CKDU_DIR_BUFFER_SIZE (1 << 20)
+
+typedef struct _ckdu_dir_reader {
+	/* Reused for every directory, one per thread */
+	char *buffer;
+	size_t pos;
+	size_t len;
+} ckdu_dir_reader;
+
+bool is_dot_or_dot_dot(const char *basename) {
+	return (basename[0] == '.')
+		&& ((basename[1] == '\0')
+			|| ((basename[1] == '.') && (basename[2] == '\0')));
+}
+
+struct dirent64 * dir_reader_next(ckdu_dir_reader *reader, int dir_fd) {
+	/* Returns NULL at the end of the directory, or on error with errno set */
+	struct dirent64 *entry;
+
+	do {
+		if (reader->pos >= reader->len) {
+			ssize_t const res = getdents64(dir_fd, reader->buffer, CKDU_DIR_BUFFER_SIZE);
+			reader->pos = 0;
+			if (res <= 0) {
+				reader->len = 0;
+				return NULL;
+			}
+			reader->len = res;
+		}
+
+		entry = (struct dirent64 *)(reader->buffer + reader->pos);
+		reader->pos += entry->d_reclen;
+	} while (is_dot_or_dot_dot(entry->d_name));
+
+	return entry;
+}
+
+typedef struct _ckdu_listed_entry {
+	ino64_t inode;
+	size_t offset;
+} ckdu_listed_entry;
+
+typedef struct _ckdu_dir_listing {
+	/* Copies of the records returned by getdents64() */
+	char *records;
+	size_t records_len;
+	size_t records_capacity;
+
+	ckdu_listed_entry *entries;
+	size_t count;
+	size_t capacity;
+	size_t next;
+} ckdu_dir_listing;
+
+int compare_listed_entries(const void *void_a, const void *void_b) {
+	ckdu_listed_entry const * const a = (ckdu_listed_entry const *)void_a;
+	ckdu_listed_entry const * const b = (ckdu_listed_entry const *)void_b;
+	return (a->inode > b->inode) - (a->inode < b->inode);
+}
+
+int list_directory(ckdu_dir_listing *listing, ckdu_dir_reader *reader, int dir_fd) {
+	/* Reads the whole directory and sorts it by inode number, so that
+	 * the inode table is visited in one sweep rather than at random */
+	struct dirent64 *entry;
+	int res = 0;
+
+	listing->records_len = 0;
+	listing->count = 0;
+	listing->next = 0;
+
+	for (;;) {
+		errno = 0;
+		entry = dir_reader_next(reader, dir_fd);
+		if (!entry) {
+			res = errno;
+			break;
+		}
+
+		if (listing->records_len + entry->d_reclen > listing->records_capacity) {
+			size_t const capacity = 2 * listing->records_capacity + entry->d_reclen;
+			char * const records = realloc(listing->records, capacity);
+			if (!records) {
+				handle_out_of_memory();
+			}
+			listing->records = records;
+			listing->records_capacity = capacity;
+		}
+		if (listing->count == listing->capacity) {
+			size_t const capacity = listing->capacity ? 2 * listing->capacity : 256;
+			ckdu_listed_entry * const entries = realloc(listing->entries, capacity * sizeof(ckdu_listed_entry));
+			if (!entries) {
+				handle_out_of_memory();
+			}
+			listing->entries = entries;
+			listing->capacity = capacity;
+		}
+
+		memcpy(listing->records + listing->records_len, entry, entry->d_reclen);
+		listing->entries[listing->count].inode = entry->d_ino;
+		listing->entries[listing->count].offset = listing->records_len;
+		listing->records_len += entry->d_reclen;
+		listing->count++;
+	}
+
+	qsort(listing->entries, listing->count, sizeof(ckdu_listed_entry), compare_listed_entries);
+	return res;
+}
+
+struct dirent64 * dir_listing_next(ckdu_dir_listing *listing) {
+	if (listing->next == listing->count) {
+		return NULL;
+	}
+	return (struct dirent64 *)(listing->records + listing->entries[listing->next++].offset);
+}
+
+typedef struct _ckdu_staging {
+	/* Children of the directory being scanned, so that
+	 * they can go into the tree next to each other */
+	ckdu_staged_entry *entries;
+	size_t count;
+	size_t capacity;
+
+	char *names;
+	size_t names_len;
+	size_t names_capacity;
+
+	/* Positions of staged files, for picking the biggest */
+	ckdu_index *files;
+	size_t files_capacity;
+} ckdu_staging;
+
+void staging_reserve_names(ckdu_staging *staging, size_t len) {
+	if (staging->names_len + len > staging->names_capacity) {
+		size_t const capacity = 2 * staging->names_capacity + len;
+		char * const names = realloc(staging->names, capacity);
+		if (!names) {
+			handle_out_of_memory();
+		}
+		staging->names = names;
+		staging->names_capacity = capacity;
+	}
+}
+
+ckdu_staged_entry * stage_entry(ckdu_staging *staging, const char *basename) {
+	size_t const len = strlen(basename) + 1;
+	ckdu_staged_entry *entry;
+
+	if (staging->count == staging->capacity) {
+		size_t const capacity = staging->capacity ? 2 * staging->capacity : 256;
+		ckdu_staged_entry * const entries = realloc(staging->entries, capacity * sizeof(ckdu_staged_entry));
+		if (!entries) {
+			handle_out_of_memory();
+		}
+		staging->entries = entries;
+		staging->capacity = capacity;
+	}
+	staging_reserve_names(staging, len);
+
+	entry = staging->entries + staging->count++;
+	entry->name_pos = staging->names_len;
+	entry->name_len = len;
+	entry->fd = -1;
+	memcpy(staging->names + staging->names_len, basename, len);
+	staging->names_len += len;
+	return entry;
+}
+
+void unstage_entry(ckdu_staging *staging) {
+	/* Drops the entry staged last */
+	staging->count--;
+	staging->names_len = staging->entries[staging->count].name_pos;
+}
+
+typedef struct _ckdu_uring_slot {
+	char name[256];
+	struct statx props;
+	int res;
+	int fd;
+	int remaining;  /* Requests not completed yet */
+} ckdu_uring_slot;
+
+typedef struct _ckdu_worker {
+	ckdu_crawler *crawler;
+	unsigned int index;
+	pthread_t thread;
+
+	/* Where this thread's names go */
+	ckdu_name_block names;
+
+	/* Most entries live on the same device as the one before */
+	dev_t last_device;
+	uint32_t last_device_index;
+	bool has_last_device;
+
+	ckdu_dir_reader reader;
+	ckdu_dir_listing listing;
+	ckdu_staging staging;
+
+	/* Only used with --top */
+	ckdu_top_files top_files;
+
+	/* Only used with --since, subdirectories of the previous
+	 * counterpart of the directory being scanned, by name */
+	ckdu_index *previous_dirs;
+	size_t previous_dir_count;
+	size_t previous_dirs_capacity;
+
+	/* Only used with --since, see adopt_children */
+	ckdu_index *adoptions;
+	size_t adoption_count;
+	size_t adoptions_capacity;
+
+	/* Only used with --stream */
+	ckdu_output stream;
+
+	/* NULL with the synchronous engine */
+	ckdu_uring *ring;
+	ckdu_uring_slot *slots;
+	unsigned int *free_slots;
+	unsigned int slot_count;
+} ckdu_worker;
+
+void deque_push(ckdu_deque *deque, ckdu_crawl_job *job) {
+	pthread_mutex_lock(&deque->lock);
+	if (deque->tail == deque->capacity) {
+		if (deque->head > 0) {
+			memmove(deque->jobs, deque->jobs + deque->head,
+					(deque->tail - deque->head) * sizeof(ckdu_crawl_job *));
+			deque->tail -= deque->head;
+			deque->head = 0;
+		} else {
+			size_t const capacity = deque->capacity ? 2 * deque->capacity : 64;
+			ckdu_crawl_job ** const jobs = realloc(deque->jobs, capacity * sizeof(ckdu_crawl_job *));
+			if (!jobs) {
+				handle_out_of_memory();
+			}
+			deque->jobs = jobs;
+			deque->capacity = capacity;
+		}
+	}
+	deque->jobs[deque->tail++] = job;
+	pthread_mutex_unlock(&deque->lock);
+}
+
+ckdu_crawl_job * deque_pop(ckdu_deque *deque) {
+	ckdu_crawl_job *job = NULL;
+	pthread_mutex_lock(&deque->lock);
+	if (deque->tail > deque->head) {
+		job = deque->jobs[--deque->tail];
+	}
+	pthread_mutex_unlock(&deque->lock);
+	return job;
+}
+
+ckdu_crawl_job * deque_steal(ckdu_deque *deque) {
+	ckdu_crawl_job *job = NULL;
+	pthread_mutex_lock(&deque->lock);
+	if (deque->tail > deque->head) {
+		job = deque->jobs[deque->head++];
+	}
+	pthread_mutex_unlock(&deque->lock);
+	return job;
+}
+
+void push_job(ckdu_worker *worker, ckdu_crawl_job *job) {
+	ckdu_crawler * const crawler = worker->crawler;
+
+	deque_push(crawler->deques + worker->index, job);
+
+	pthread_mutex_lock(&crawler->idle_lock);
+	crawler->queued++;
+	crawler->outstanding++;
+	if (crawler->sleeping) {
+		pthread_cond_signal(&crawler->idle_cond);
+	}
+	pthread_mutex_unlock(&crawler->idle_lock);
+}
+
+ckdu_crawl_job * take_job(ckdu_worker *worker) {
+	ckdu_crawler * const crawler = worker->crawler;
+	ckdu_crawl_job *job = deque_pop(crawler->deques + worker->index);
+	unsigned int i = 1;
+
+	/* Own deque is empty, try to steal the oldest (and hence
+	 * usually biggest) job of somebody else */
+	for (; !job && (i < crawler->worker_count); i++) {
+		job = deque_steal(crawler->deques + (worker->index + i) % crawler->worker_count);
+	}
+
+	if (job) {
+		pthread_mutex_lock(&crawler->idle_lock);
+		crawler->queued--;
+		pthread_mutex_unlock(&crawler->idle_lock);
+	}
+	return job;
+}
+
+void mark_shared_dir(ckdu_crawler *crawler, ckdu_index dir) {
+	/* Nobody saves the daemon's tree */
+	if (!crawler->options->daemon) {
+		tree_add_shared_dir(crawler->tree, dir);
+	}
+}
+
+bool claim_inode(ckdu_crawler *crawler, dev_t device, uint64_t inode, ckdu_index first) {
+	bool inserted;
+	pthread_mutex_lock(&crawler->pool_lock);
+	inode_set_insert(crawler->inode_set, device, inode, first, &inserted);
+	pthread_mutex_unlock(&crawler->pool_lock);
+	return inserted;
+}
+
+void share_inode(ckdu_crawler *crawler, ckdu_staged_entry const *entry, ckdu_index first,
+		bool folded, bool listed) {
+	ckdu_inode_slot *slot;
+	bool inserted;
+
+	pthread_mutex_lock(&crawler->pool_lock);
+	slot = inode_set_insert(crawler->inode_set, entry->device, entry->inode, first, &inserted);
+	if (inserted || ((first != slot->first)
+			&& (compare_trees_path_wise(crawler->tree, first, slot->first) < 0))) {
+		/* Whichever link comes first path-wise gets the content */
+		slot->content_size = entry->content_size;
+		slot->first = first;
+		slot->folded = folded;
+		slot->listed = listed;
+		slot->shared = true;
+	} else if (first == slot->first) {
+		slot->listed |= listed;
+	}
+	pthread_mutex_unlock(&crawler->pool_lock);
+
+	mark_shared_dir(crawler, folded ? first : CKDU_AT(crawler->tree->parent, first));
+}
+
+char const * job_name(ckdu_tree const *tree, ckdu_crawl_job const *job) {
+	return job->name ? job->name : tree_name(tree, job->node);
+}
+
+void release_dir(ckdu_crawl_job *job) {
+	if ((__sync_sub_and_fetch(&job->dir_users, 1) == 0) && (job->dir_fd != -1)) {
+		close(job->dir_fd);
+		job->dir_fd = -1;
+	}
+}
+
+char * malloc_job_path(ckdu_crawler const *crawler, ckdu_crawl_job const *job) {
+	/* Like malloc_tree_path, plus the names of jobs outside the tree */
+	ckdu_crawl_job const *up = job;
+	size_t extra_len = 0;
+	size_t tree_len;
+	char *target;
+	char *write;
+
+	for (; up->name; up = up->parent) {
+		extra_len += 1 + strlen(up->name);
+	}
+
+	target = malloc_tree_path(crawler->root_dirname, crawler->tree, up->node);
+	if (!target || !extra_len) {
+		return target;
+	}
+	tree_len = strlen(target);
+	write = realloc(target, tree_len + extra_len + 1);
+	if (!write) {
+		free(target);
+		errno = ENOMEM;
+		return NULL;
+	}
+	target = write;
+
+	write = target + tree_len + extra_len;
+	*write = '\0';
+	for (up = job; up->name; up = up->parent) {
+		size_t const len_name = strlen(up->name);
+		write -= len_name;
+		memcpy(write, up->name, len_name);
+		*--write = '/';
+	}
+
+	return target;
+}
+
+void report_crawl_error(ckdu_crawler const *crawler, void (*handler)(int, const char *),
+		int code, ckdu_crawl_job const *job) {
+	char * const dirname = malloc_job_path(crawler, job);
+	if (!dirname) {
+		handle_out_of_memory();
+	}
+	handler(code, dirname);
+	free(dirname);
+}
+
+void report_stat_error(ckdu_crawler const *crawler, int code,
+		ckdu_crawl_job const *job, const char *basename) {
+	char * const dirname = malloc_job_path(crawler, job);
+	if (!dirname) {
+		handle_out_of_memory();
+	}
+	handle_stat_error(code, dirname, basename);
+	free(dirname);
+}
+
+void stream_record_start(ckdu_output *output, char const *type, char const *path) {
+	output_string(output, "{\"type\":\"");
+	output_string(output, type);
+	output_string(output, "\",\"path\":\"");
+	output_json_escaped(output, path);
+}
+
+void stream_record_end(ckdu_output *output) {
+	output_bytes(output, "}\n", 2);
+	if (output->len >= CKDU_OUTPUT_BUFFER_SIZE) {
+		output_flush(output);
+	}
+}
+
+void stream_entries(ckdu_worker *worker, ckdu_crawl_job const *job) {
+	/* Everything staged, the moment it has been examined */
+	ckdu_staging const * const staging = &worker->staging;
+	ckdu_output * const output = &worker->stream;
+	char * const dirname = malloc_job_path(worker->crawler, job);
+	size_t i = 0;
+
+	if (!dirname) {
+		handle_out_of_memory();
+	}
+	for (; i < staging->count; i++) {
+		ckdu_staged_entry const * const entry = staging->entries + i;
+
+		stream_record_start(output, "entry", dirname);
+		output_bytes(output, "/", 1);
+		output_json_escaped(output, staging->names + entry->name_pos);
+		output_bytes(output, "\"", 1);
+		output_json_number(output, "size", (uint64_t)entry->content_size);
+		output_json_number(output, "mode", entry->mode);
+		output_json_number(output, "inode", entry->inode);
+		output_json_number(output, "device", entry->device);
+		stream_record_end(output);
+	}
+	free(dirname);
+}
+
+void stream_directory(ckdu_worker *worker, ckdu_crawl_job const *job) {
+	/* Once its content has been added up */
+	ckdu_output * const output = &worker->stream;
+	char * const path = malloc_job_path(worker->crawler, job);
+
+	if (!path) {
+		handle_out_of_memory();
+	}
+	stream_record_start(output, "dir", path);
+	output_bytes(output, "\"", 1);
+	output_json_number(output, "size", (uint64_t)(job->own_size + job->content_below));
+	stream_record_end(output);
+	free(path);
+}
+
+void release_job(ckdu_worker *worker, ckdu_crawl_job *job) {
+	/* The last one out finishes the directory and rolls
+	 * its size up into the parent, possibly repeatedly */
+	ckdu_crawler * const crawler = worker->crawler;
+	ckdu_tree * const tree = crawler->tree;
+
+	while (job && (__sync_sub_and_fetch(&job->pending, 1) == 0)) {
+		ckdu_crawl_job * const parent = job->parent;
+
+		if (parent && !job->name) {
+			__sync_fetch_and_add(&CKDU_AT(tree->total_size, parent->node),
+					CKDU_AT(tree->total_size, job->node));
+		}
+		if (parent) {
+			__sync_fetch_and_add(&parent->content_below, job->content_below);
+		}
+		if (crawler->options->stream) {
+			stream_directory(worker, job);
+		}
+
+		free(job);
+		job = parent;
+	}
+}
+
+bool take_preopen_budget(ckdu_crawler *crawler) {
+	if (__sync_sub_and_fetch(&crawler->preopen_budget, 1) >= 0) {
+		return true;
+	}
+	__sync_fetch_and_add(&crawler->preopen_budget, 1);
+	return false;
+}
+
+void discard_preopened(ckdu_crawler *crawler, int fd) {
+	if (fd != -1) {
+		close(fd);
+		__sync_fetch_and_add(&crawler->preopen_budget, 1);
+	}
+}
+
+uint32_t worker_device_index(ckdu_worker *worker, dev_t device) {
+	if (!worker->has_last_device || (worker->last_device != device)) {
+		worker->last_device = device;
+		worker->last_device_index = tree_device_index(worker->crawler->tree, device);
+		worker->has_last_device = true;
+	}
+	return worker->last_device_index;
+}
+
+int compare_indices_by_name(const void *void_a, const void *void_b, void *void_tree) {
+	ckdu_tree const * const tree = (ckdu_tree const *)void_tree;
+	return strcmp(tree_name(tree, *(ckdu_index const *)void_a),
+			tree_name(tree, *(ckdu_index const *)void_b));
+}
+
+void list_previous_dirs(ckdu_worker *worker, ckdu_index previous) {
+	/* Sorted by name, for find_previous_dir */
+	ckdu_tree const * const tree = worker->crawler->previous;
+	ckdu_index const first = CKDU_AT(tree->first_child, previous);
+	uint32_t const count = CKDU_AT(tree->child_count, previous);
+	uint32_t i = 0;
+
+	if (count > worker->previous_dirs_capacity) {
+		ckdu_index * const dirs = realloc(worker->previous_dirs, count * sizeof(ckdu_index));
+		if (!dirs) {
+			handle_out_of_memory();
+		}
+		worker->previous_dirs = dirs;
+		worker->previous_dirs_capacity = count;
+	}
+
+	worker->previous_dir_count = 0;
+	for (; i < count; i++) {
+		if (is_nonlink_dir(CKDU_AT(tree->mode, first + i))) {
+			worker->previous_dirs[worker->previous_dir_count++] = first + i;
+		}
+	}
+	if (worker->previous_dir_count) {
+		/* Nothing allocated yet otherwise */
+		qsort_r(worker->previous_dirs, worker->previous_dir_count, sizeof(ckdu_index),
+				compare_indices_by_name, (void *)tree);
+	}
+}
+
+ckdu_index find_previous_dir(ckdu_worker const *worker, char const *name) {
+	ckdu_tree const * const tree = worker->crawler->previous;
+	size_t low = 0;
+	size_t high = worker->previous_dir_count;
+
+	while (low < high) {
+		size_t const middle = low + (high - low) / 2;
+		ckdu_index const candidate = worker->previous_dirs[middle];
+		int const order = strcmp(name, tree_name(tree, candidate));
+		if (!order) {
+			return candidate;
+		} else if (order < 0) {
+			high = middle;
+		} else {
+			low = middle + 1;
+		}
+	}
+	return CKDU_NO_INDEX;
+}
+
+bool is_unchanged_dir(ckdu_tree const *tree, ckdu_index previous, ckdu_staged_entry const *entry) {
+	/* Adding, removing or renaming entries bumps the modification
+	 * time, replacing the directory changes the inode number. Sizes
+	 * of files changed in place inside go unnoticed. */
+	return (CKDU_AT(tree->inode, previous) == entry->inode)
+		&& (tree->devices[CKDU_AT(tree->device, previous)] == entry->device)
+		&& (CKDU_AT(tree->mtime, previous) == entry->mtime)
+		&& (CKDU_AT(tree->ctime, previous) == entry->ctime);
+}
+
+void adopt_file_columns(ckdu_tree *tree, ckdu_index index, ckdu_tree const *previous_tree, ckdu_index previous) {
+	/* Both trees have been made with the same options */
+	if (tree->file_aggregates) {
+		CKDU_AT(tree->file_count, index) = CKDU_AT(previous_tree->file_count, previous);
+		CKDU_AT(tree->file_size, index) = CKDU_AT(previous_tree->file_size, previous);
+		CKDU_AT(tree->largest_file, index) = CKDU_AT(previous_tree->largest_file, previous);
+	}
+	if (tree->other_buckets) {
+		CKDU_AT(tree->other_count, index) = CKDU_AT(previous_tree->other_count, previous);
+		CKDU_AT(tree->other_size, index) = CKDU_AT(previous_tree->other_size, previous);
+	}
+}
+
+void push_adoption(ckdu_worker *worker, ckdu_index previous, ckdu_index index) {
+	if (worker->adoption_count + 2 > worker->adoptions_capacity) {
+		size_t const capacity = worker->adoptions_capacity ? 2 * worker->adoptions_capacity : 64;
+		ckdu_index * const adoptions = realloc(worker->adoptions, capacity * sizeof(ckdu_index));
+		if (!adoptions) {
+			handle_out_of_memory();
+		}
+		worker->adoptions = adoptions;
+		worker->adoptions_capacity = capacity;
+	}
+	worker->adoptions[worker->adoption_count++] = previous;
+	worker->adoptions[worker->adoption_count++] = index;
+}
+
+void adopt_children(ckdu_worker *worker, ckdu_index previous, ckdu_index index) {
+	/* Copies whatever the snapshot has below a directory into the
+	 * tree, without looking at the file system. Pairs of snapshot and
+	 * tree index wait on a stack of their own, as trees can be deep. */
+	ckdu_crawler * const crawler = worker->crawler;
+	ckdu_tree * const tree = crawler->tree;
+	ckdu_tree const * const previous_tree = crawler->previous;
+
+	push_adoption(worker, previous, index);
+	while (worker->adoption_count) {
+		ckdu_index const to_dir = worker->adoptions[--worker->adoption_count];
+		ckdu_index const from_dir = worker->adoptions[--worker->adoption_count];
+		ckdu_index const from_first = CKDU_AT(previous_tree->first_child, from_dir);
+		uint32_t const count = CKDU_AT(previous_tree->child_count, from_dir);
+		ckdu_index first;
+		uint32_t i = 0;
+
+		adopt_file_columns(tree, to_dir, previous_tree, from_dir);
+		if (!count) {
+			continue;
+		}
+
+		first = tree_reserve(tree, count);
+		CKDU_AT(tree->first_child, to_dir) = first;
+		CKDU_AT(tree->child_count, to_dir) = count;
+
+		for (; i < count; i++) {
+			ckdu_index const from = from_first + i;
+			ckdu_index const to = first + i;
+			char const * const name = tree_name(previous_tree, from);
+			dev_t const device = previous_tree->devices[CKDU_AT(previous_tree->device, from)];
+			mode_t const mode = CKDU_AT(previous_tree->mode, from);
+
+			CKDU_AT(tree->name_offset, to) = tree_add_name(tree, &worker->names, name, strlen(name) + 1);
+			CKDU_AT(tree->content_size, to) = CKDU_AT(previous_tree->content_size, from);
+			CKDU_AT(tree->total_size, to) = CKDU_AT(previous_tree->total_size, from);
+			CKDU_AT(tree->inode, to) = CKDU_AT(previous_tree->inode, from);
+			CKDU_AT(tree->mode, to) = mode;
+			CKDU_AT(tree->device, to) = worker_device_index(worker, device);
+			CKDU_AT(tree->parent, to) = to_dir;
+			CKDU_AT(tree->first_child, to) = CKDU_NO_INDEX;
+			CKDU_AT(tree->child_count, to) = 0;
+			CKDU_AT(tree->mtime, to) = CKDU_AT(previous_tree->mtime, from);
+			CKDU_AT(tree->ctime, to) = CKDU_AT(previous_tree->ctime, from);
+			adopt_file_columns(tree, to, previous_tree, from);
+
+			if (is_symlink(mode)) {
+				/* Saves the readlink when the tree gets saved */
+				char const * const target = tree_name_at(previous_tree, CKDU_AT(previous_tree->link_offset, from));
+				size_t const len = strlen(target) + 1;
+				tree_cache_link(tree, to, memcpy(malloc_or_die(len), target, len));
+			} else if (!is_nonlink_dir(mode)) {
+				continue;
+			} else if (claim_inode(crawler, device, CKDU_AT(tree->inode, to), to)) {
+				push_adoption(worker, from, to);
+			} else {
+				/* Counted elsewhere already this time, e.g. through a bind
+				 * mount crawled first, so left out like when crawling */
+				off_t const below = CKDU_AT(tree->total_size, to) - CKDU_AT(tree->content_size, to);
+				ckdu_index up = to_dir;
+
+				CKDU_AT(tree->total_size, to) = CKDU_AT(tree->content_size, to);
+				for (;; up = CKDU_AT(tree->parent, up)) {
+					CKDU_AT(tree->total_size, up) -= below;
+					if (up == index) {
+						break;
+					}
+				}
+			}
+		}
+	}
+}
+
+void add_child(ckdu_worker *worker, ckdu_crawl_job *job, ckdu_index index,
+		ckdu_staged_entry const *entry, const char *name, off_t *add_content_size) {
+	/* Takes care of entry->fd, which is -1 unless opened ahead of time.
+	 * Entries below --max-depth come without an index and are only counted. */
+	ckdu_crawler * const crawler = worker->crawler;
+	bool const in_tree = (index != CKDU_NO_INDEX);
+
+	if (is_nonlink_dir(entry->mode)) {
+		/* Directories seen before (e.g. through a bind mount) are
+		 * neither counted nor entered a second time */
+		if (claim_inode(crawler, entry->device, entry->inode, in_tree ? index : job->node)) {
+			bool const boring = (crawler->options->boring_mode != CKDU_BORING_FULL)
+					&& is_boring_folder(name, crawler->options);
+			size_t const name_size = in_tree ? 0 : strlen(name) + 1;
+			ckdu_index previous = CKDU_NO_INDEX;
+			bool unchanged = false;
+			ckdu_crawl_job *child_job;
+
+			if (boring && (crawler->options->boring_mode == CKDU_BORING_SKIP)) {
+				*add_content_size += entry->content_size;
+				discard_preopened(crawler, entry->fd);
+				return;
+			}
+
+			if (in_tree && (job->previous != CKDU_NO_INDEX)) {
+				previous = find_previous_dir(worker, name);
+				unchanged = (previous != CKDU_NO_INDEX)
+						&& is_unchanged_dir(crawler->previous, previous, entry);
+				if (unchanged && job->unchanged && !crawler->shared_below[previous]) {
+					/* Taken from the snapshot rather than crawled, with its own
+					 * size fresh. Whatever changed in place inside is missed,
+					 * unlike right inside directories that did change. */
+					ckdu_tree * const tree = crawler->tree;
+					CKDU_AT(tree->total_size, index) += CKDU_AT(crawler->previous->total_size, previous)
+							- CKDU_AT(crawler->previous->content_size, previous);
+					adopt_children(worker, previous, index);
+					*add_content_size += CKDU_AT(tree->total_size, index);
+					discard_preopened(crawler, entry->fd);
+					return;
+				}
+			}
+
+			child_job = malloc(sizeof(ckdu_crawl_job) + name_size);
+			if (!child_job) {
+				handle_out_of_memory();
+			}
+			if (in_tree) {
+				child_job->node = index;
+				child_job->name = NULL;
+			} else {
+				child_job->node = job->node;
+				child_job->name = (char *)(child_job + 1);
+				memcpy(child_job->name, name, name_size);
+
+				/* Nobody rolls this one up later */
+				*add_content_size += entry->content_size;
+			}
+			child_job->own_size = entry->content_size;
+			child_job->content_below = 0;
+			child_job->depth = job->depth + 1;
+			child_job->parent = job;
+			child_job->fd = entry->fd;
+			child_job->dir_fd = -1;
+			child_job->dir_users = 1;
+			child_job->pending = 1;
+			child_job->shallow = boring;
+			child_job->previous = previous;
+			child_job->unchanged = unchanged;
+
+			if (entry->fd == -1) {
+				__sync_fetch_and_add(&job->dir_users, 1);
+			}
+			__sync_fetch_and_add(&job->pending, 1);
+			push_job(worker, child_job);
+			return;
+		}
+		mark_shared_dir(crawler, job->node);
+	} else if ((entry->link_count > 1) && crawler->options->stream) {
+		/* Nothing waits for the end, the first link found counts */
+		if (claim_inode(crawler, entry->device, entry->inode, job->node)) {
+			*add_content_size += entry->content_size;
+		}
+	} else if (entry->link_count > 1) {
+		/* Counted after crawling, once all links are known */
+		share_inode(crawler, entry, in_tree ? index : job->node, !in_tree, !in_tree && !job->name);
+	} else {
+		/* Nobody else can point at this inode */
+		*add_content_size += entry->content_size;
+	}
+
+	discard_preopened(crawler, entry->fd);
+}
+
+void sum_up_children(ckdu_worker *worker, off_t *add_content_size) {
+	/* Staged entries count as they are, without looking any deeper */
+	ckdu_staging * const staging = &worker->staging;
+	size_t i = 0;
+
+	for (; i < staging->count; i++) {
+		*add_content_size += staging->entries[i].content_size;
+		discard_preopened(worker->crawler, staging->entries[i].fd);
+	}
+
+	staging->count = 0;
+	staging->names_len = 0;
+}
+
+bool is_kept_in_tree(ckdu_staged_entry const *entry, ckdu_options const *options) {
+	/* Files with an empty name did not make it into the top entries */
+	return is_nonlink_dir(entry->mode)
+		|| (!options->dirs_only && !options->top && entry->name_len);
+}
+
+void aggregate_files(ckdu_tree *tree, ckdu_index dir, ckdu_staging const *staging) {
+	/* Files with more than one link are left to resolve_shared_inodes,
+	 * which counts them in only where their content is counted */
+	uint32_t file_count = 0;
+	off_t file_size = 0;
+	off_t largest_file = 0;
+	size_t i = 0;
+
+	for (; i < staging->count; i++) {
+		ckdu_staged_entry const * const entry = staging->entries + i;
+		if (!is_nonlink_dir(entry->mode) && (entry->link_count <= 1)) {
+			file_count++;
+			file_size += entry->content_size;
+			if (entry->content_size > largest_file) {
+				largest_file = entry->content_size;
+			}
+		}
+	}
+
+	CKDU_AT(tree->file_count, dir) = file_count;
+	CKDU_AT(tree->file_size, dir) = file_size;
+	CKDU_AT(tree->largest_file, dir) = largest_file;
+}
+
+int compare_staged_files(const void *void_a, const void *void_b, void *void_staging) {
+	/* Same order as on output, for files */
+	ckdu_staging const * const staging = (ckdu_staging const *)void_staging;
+	ckdu_staged_entry const * const a = staging->entries + *(ckdu_index const *)void_a;
+	ckdu_staged_entry const * const b = staging->entries + *(ckdu_index const *)void_b;
+
+	if (a->content_size != b->content_size) {
+		return (a->content_size < b->content_size) ? 1 : -1;
+	}
+	return strcmp(staging->names + a->name_pos, staging->names + b->name_pos);
+}
+
+void bucket_small_files(ckdu_tree *tree, ckdu_index dir, ckdu_staging *staging,
+		size_t limit, off_t min_size) {
+	/* Leaves the limit biggest files of at least min_size marked for
+	 * the tree, by setting name_len of all others to zero. Their sizes
+	 * go into the bucket. A limit of zero means no limit. */
+	uint32_t other_count = 0;
+	off_t other_size = 0;
+	size_t file_count = 0;
+	size_t i = 0;
+
+	if (staging->count > staging->files_capacity) {
+		ckdu_index * const files = realloc(staging->files, staging->capacity * sizeof(ckdu_index));
+		if (!files) {
+			handle_out_of_memory();
+		}
+		staging->files = files;
+		staging->files_capacity = staging->capacity;
+	}
+
+	for (; i < staging->count; i++) {
+		ckdu_staged_entry * const entry = staging->entries + i;
+		if (is_nonlink_dir(entry->mode)) {
+			continue;
+		}
+		if (entry->content_size < min_size) {
+			entry->name_len = 0;
+			other_count++;
+			other_size += entry->content_size;
+		} else {
+			staging->files[file_count++] = i;
+		}
+	}
+
+	if (limit && (file_count > limit)) {
+		select_first(staging->files, file_count, limit, compare_staged_files, staging);
+		for (i = limit; i < file_count; i++) {
+			ckdu_staged_entry * const entry = staging->entries + staging->files[i];
+			entry->name_len = 0;
+			other_count++;
+			other_size += entry->content_size;
+		}
+	}
+
+	CKDU_AT(tree->other_count, dir) = other_count;
+	CKDU_AT(tree->other_size, dir) = other_size;
+}
+
+void commit_children(ckdu_worker *worker, ckdu_crawl_job *job, off_t *add_content_size) {
+	/* Moves staged entries into the tree, side by side. With
+	 * --dirs-only, files are counted like those below --max-depth. */
+	ckdu_tree * const tree = worker->crawler->tree;
+	ckdu_staging * const staging = &worker->staging;
+	ckdu_options const * const options = worker->crawler->options;
+	uint32_t count = 0;
+	ckdu_index next;
+	size_t i = 0;
+
+	if (options->dirs_only) {
+		aggregate_files(tree, job->node, staging);
+	} else if (tree->other_buckets) {
+		bucket_small_files(tree, job->node, staging, options->max_entries, options->threshold);
+	}
+	for (; i < staging->count; i++) {
+		count += is_kept_in_tree(staging->entries + i, options);
+	}
+
+	if (count) {
+		next = tree_reserve(tree, count);
+		CKDU_AT(tree->first_child, job->node) = next;
+		CKDU_AT(tree->child_count, job->node) = count;
+	}
+	if (job->previous != CKDU_NO_INDEX) {
+		list_previous_dirs(worker, job->previous);
+	}
+
+	for (i = 0; i < staging->count; i++) {
+		ckdu_staged_entry const * const entry = staging->entries + i;
+		char const * const name = staging->names + entry->name_pos;
+
+		if (!is_kept_in_tree(entry, options)) {
+			if (options->top && !is_nonlink_dir(entry->mode)) {
+				top_files_offer(&worker->top_files, job->node, entry->content_size, name);
+			}
+			add_child(worker, job, CKDU_NO_INDEX, entry, name, add_content_size);
+		} else {
+			uint64_t const name_offset = tree_add_name(tree, &worker->names, name, entry->name_len);
+			tree_set_entry(tree, next, entry, name_offset,
+					worker_device_index(worker, entry->device), job->node);
+			add_child(worker, job, next, entry, tree_name(tree, next), add_content_size);
+			next++;
+		}
+	}
+
+	staging->count = 0;
+	staging->names_len = 0;
+}
+
+void fold_children(ckdu_worker *worker, ckdu_crawl_job *job, off_t *add_content_size) {
+	/* Below --max-depth, entries are counted but never stored */
+	ckdu_staging * const staging = &worker->staging;
+	size_t i = 0;
+
+	for (; i < staging->count; i++) {
+		ckdu_staged_entry const * const entry = staging->entries + i;
+		add_child(worker, job, CKDU_NO_INDEX, entry, staging->names + entry->name_pos, add_content_size);
+	}
+
+	staging->count = 0;
+	staging->names_len = 0;
+}
+
+struct dirent64 * next_dir_entry(ckdu_worker *worker, int dir_fd) {
+	/* Sorted listing has been made up front in inode order mode */
+	if (worker->crawler->options->inode_order) {
+		errno = 0;
+		return dir_listing_next(&worker->listing);
+	}
+	return dir_reader_next(&worker->reader, dir_fd);
+}
+
+void scan_entries_sync(ckdu_worker *worker, ckdu_crawl_job *job) {
+	ckdu_crawler * const crawler = worker->crawler;
+	int const dir_fd = job->dir_fd;
+	struct dirent64 *entry;
+
+	do {
+		errno = 0;
+		entry = next_dir_entry(worker, dir_fd);
+		if (!entry) {
+			if (errno) {
+				report_crawl_error(crawler, handle_readdir_error, errno, job);
+			}
+		} else {
+			ckdu_staged_entry * const staged = stage_entry(&worker->staging, entry->d_name);
+
+			errno = 0;
+			if (fetch_metadata(staged, dir_fd, entry->d_name, crawler->options)) {
+				report_stat_error(crawler, errno, job, entry->d_name);
+				unstage_entry(&worker->staging);
+			}
+		}
+	} while (entry);
+}
+
+void complete_uring_slot(ckdu_worker *worker, ckdu_crawl_job *job, ckdu_uring_slot *slot) {
+	ckdu_crawler * const crawler = worker->crawler;
+	ckdu_staged_entry * const staged = stage_entry(&worker->staging, slot->name);
+	int const dir_fd = job->dir_fd;
+	int res = 0;
+
+	if (slot->res == -EINVAL) {
+		/* Kernel too old for IORING_OP_STATX */
+		res = fetch_metadata(staged, dir_fd, slot->name, crawler->options);
+	} else if (slot->res < 0) {
+		errno = -slot->res;
+		res = -1;
+	} else {
+		apply_statx(staged, &slot->props, crawler->options);
+	}
+
+	if (res) {
+		report_stat_error(crawler, errno, job, slot->name);
+		unstage_entry(&worker->staging);
+		discard_preopened(crawler, slot->fd);
+	} else {
+		staged->fd = slot->fd;
+	}
+}
+
+void scan_entries_uring(ckdu_worker *worker, ckdu_crawl_job *job) {
+	ckdu_crawler * const crawler = worker->crawler;
+	ckdu_uring * const ring = worker->ring;
+	int const dir_fd = job->dir_fd;
+	unsigned int const mask = statx_mask(crawler->options);
+	int const flags = statx_flags(crawler->options);
+	unsigned int free_count = worker->slot_count;
+	unsigned int in_flight = 0;
+	bool exhausted = false;
+
+	/* Keep up to queue depth requests in flight: one statx per entry
+	 * plus an openat for each entry that looks like a directory */
+	while (!exhausted || in_flight) {
+		struct io_uring_cqe *cqe;
+
+		while (!exhausted && free_count) {
+			struct dirent64 *entry;
+			unsigned int index;
+			ckdu_uring_slot *slot;
+			struct io_uring_sqe *sqe;
+			size_t len;
+
+			errno = 0;
+			entry = next_dir_entry(worker, dir_fd);
+			if (!entry) {
+				if (errno) {
+					report_crawl_error(crawler, handle_readdir_error, errno, job);
+				}
+				exhausted = true;
+				break;
+			}
+
+			index = worker->free_slots[--free_count];
+			slot = worker->slots + index;
+			len = strlen(entry->d_name) + 1;
+			assert(len <= sizeof(slot->name));
+			memcpy(slot->name, entry->d_name, len);
+			slot->res = 0;
+			slot->fd = -1;
+			slot->remaining = 1;
+
+			sqe = uring_get_sqe(ring);
+			assert(sqe);
+			sqe->opcode = IORING_OP_STATX;
+			sqe->fd = dir_fd;
+			sqe->addr = (unsigned long)slot->name;
+			sqe->len = mask;
+			sqe->off = (unsigned long)&slot->props;
+			sqe->statx_flags = flags;
+			sqe->user_data = 2 * index;
+			in_flight++;
+
+			if ((entry->d_type == DT_DIR) && !job->shallow && take_preopen_budget(crawler)) {
+				sqe = uring_get_sqe(ring);
+				assert(sqe);
+				sqe->opcode = IORING_OP_OPENAT;
+				sqe->fd = dir_fd;
+				sqe->addr = (unsigned long)slot->name;
+				sqe->open_flags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC | O_NOATIME;
+				sqe->user_data = 2 * index + 1;
+				slot->remaining++;
+				in_flight++;
+			}
+		}
+
+		if (!in_flight) {
+			break;
+		}
+		if (uring_submit_and_wait(ring, 1) == -1) {
+			fprintf(stderr, "Error: io_uring_enter failed (%s).\n", strerror(errno));
+			exit(1);
+		}
+
+		while ((cqe = uring_peek_cqe(ring))) {
+			unsigned int const index = cqe->user_data / 2;
+			ckdu_uring_slot * const slot = worker->slots + index;
+
+			if (cqe->user_data % 2) {
+				if (cqe->res >= 0) {
+					slot->fd = cqe->res;
+				} else {
+					/* E.g. EPERM for O_NOATIME, the child will try again */
+					__sync_fetch_and_add(&crawler->preopen_budget, 1);
+				}
+			} else {
+				slot->res = cqe->res;
+			}
+			uring_cqe_seen(ring);
+			in_flight--;
+
+			if (!--slot->remaining) {
+				complete_uring_slot(worker, job, slot);
+				worker->free_slots[free_count++] = index;
+			}
+		}
+	}
+}
+
+void scan_directory(ckdu_worker *worker, ckdu_crawl_job *job) {
+	ckdu_crawler * const crawler = worker->crawler;
+	ckdu_tree * const tree = crawler->tree;
+	int fd;
+	off_t add_content_size = 0;
+
+	errno = 0;
+	if (job->fd != -1) {
+		fd = job->fd;
+		__sync_fetch_and_add(&crawler->preopen_budget, 1);
+	} else if (job->parent) {
+		fd = open_directory_at(job->parent->dir_fd, job_name(tree, job));
+		release_dir(job->parent);
+	} else {
+		/* The tree keeps the original for reading link targets */
+		fd = fcntl(crawler->root_fd, F_DUPFD_CLOEXEC, 0);
+	}
+
+	job->dir_fd = fd;
+	if (fd == -1) {
+		report_crawl_error(crawler, handle_opendir_error, errno, job);
+	} else {
+		if (crawler->options->inode_order) {
+			int const code = list_directory(&worker->listing, &worker->reader, fd);
+			if (code) {
+				report_crawl_error(crawler, handle_readdir_error, code, job);
+			}
+		}
+
+		if (worker->ring) {
+			scan_entries_uring(worker, job);
+		} else {
+			scan_entries_sync(worker, job);
+		}
+		if (crawler->options->stream) {
+			stream_entries(worker, job);
+		}
+		if (job->shallow) {
+			sum_up_children(worker, &add_content_size);
+		} else if (job->depth < crawler->options->max_depth) {
+			commit_children(worker, job, &add_content_size);
+		} else {
+			if (crawler->options->dirs_only && !job->name) {
+				aggregate_files(tree, job->node, &worker->staging);
+			}
+			fold_children(worker, job, &add_content_size);
+		}
+	}
+
+	__sync_fetch_and_add(&CKDU_AT(tree->total_size, job->node), add_content_size);
+	__sync_fetch_and_add(&job->content_below, add_content_size);
+
+	release_dir(job);
+	release_job(worker, job);
+
+	pthread_mutex_lock(&crawler->idle_lock);
+	crawler->outstanding--;
+	if (!crawler->outstanding) {
+		pthread_cond_broadcast(&crawler->idle_cond);
+	}
+	pthread_mutex_unlock(&crawler->idle_lock);
+}
+
+void * run_worker(void *void_worker) {
+	ckdu_worker * const worker = (ckdu_worker *)void_worker;
+	ckdu_crawler * const crawler = worker->crawler;
+
+	for (;;) {
+		ckdu_crawl_job * const job = take_job(worker);
+		if (job) {
+			scan_directory(worker, job);
+			continue;
+		}
+
+		pthread_mutex_lock(&crawler->idle_lock);
+		if (!crawler->outstanding) {
+			pthread_mutex_unlock(&crawler->idle_lock);
+			break;
+		}
+		if (!crawler->queued) {
+			crawler->sleeping++;
+			pthread_cond_wait(&crawler->idle_cond, &crawler->idle_lock);
+			crawler->sleeping--;
+		}
+		pthread_mutex_unlock(&crawler->idle_lock);
+	}
+
+	return NULL;
+}
+
+void resolve_shared_inodes(ckdu_crawler *crawler) {
+	ckdu_tree * const tree = crawler->tree;
+	ckdu_inode_set const * const set = crawler->inode_set;
+	size_t i = 0;
+
+	/* Add the content of each multi-link inode to the ancestors of its
+	 * first link. Nothing needs sorting again, that happens on output. */
+	for (; i < set->capacity; i++) {
+		ckdu_inode_slot const * const slot = set->slots + i;
+		ckdu_index dir;
+
+		if ((slot->first == CKDU_NO_INDEX) || !slot->shared) {
+			continue;
+		}
+		if (slot->listed && tree->file_aggregates) {
+			CKDU_AT(tree->file_count, slot->first)++;
+			CKDU_AT(tree->file_size, slot->first) += slot->content_size;
+			if (slot->content_size > CKDU_AT(tree->largest_file, slot->first)) {
+				CKDU_AT(tree->largest_file, slot->first) = slot->content_size;
+			}
+		}
+		dir = slot->folded ? slot->first : CKDU_AT(tree->parent, slot->first);
+		for (; dir != CKDU_NO_INDEX; dir = CKDU_AT(tree->parent, dir)) {
+			CKDU_AT(tree->total_size, dir) += slot->content_size;
+		}
+	}
+}
+
+long raise_file_limit(void) {
+	/* Every directory with children still waiting to be
+	 * opened relative to it holds a file descriptor */
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit)) {
+		return 1024;
+	}
+	if (limit.rlim_cur < limit.rlim_max) {
+		limit.rlim_cur = limit.rlim_max;
+		if (setrlimit(RLIMIT_NOFILE, &limit)) {
+			getrlimit(RLIMIT_NOFILE, &limit);
+		}
+	}
+	return (limit.rlim_cur == RLIM_INFINITY) ? 1048576 : (long)limit.rlim_cur;
+}
+
+int setup_uring_worker(ckdu_worker *worker, unsigned int queue_depth) {
+	/* Every slot has up to two requests in flight */
+	unsigned int const slot_count = (queue_depth + 1) / 2;
+	unsigned int i = 0;
+
+	worker->ring = malloc(sizeof(ckdu_uring));
+	worker->slots = malloc(slot_count * sizeof(ckdu_uring_slot));
+	worker->free_slots = malloc(slot_count * sizeof(unsigned int));
+	if (!worker->ring || !worker->slots || !worker->free_slots) {
+		handle_out_of_memory();
+	}
+	worker->slot_count = slot_count;
+	for (; i < slot_count; i++) {
+		worker->free_slots[i] = i;
+	}
+
+	if (uring_setup(worker->ring, 2 * slot_count)) {
+		free(worker->ring);
+		free(worker->slots);
+		free(worker->free_slots);
+		worker->ring = NULL;
+		worker->slots = NULL;
+		worker->free_slots = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+void teardown_uring_worker(ckdu_worker *worker) {
+	if (worker->ring) {
+		uring_teardown(worker->ring);
+		free(worker->ring);
+		free(worker->slots);
+		free(worker->free_slots);
+	}
+}
+
+void crawl_tree(ckdu_tree *tree, ckdu_index virtual_root, ckdu_tree const *previous,
+		ckdu_index previous_root, ckdu_inode_set *inode_set, ckdu_top_files *top_files,
+		int dir_fd, const char *dirname, ckdu_options const *options) {
+	unsigned int const worker_count = options->jobs;
+	ckdu_crawler crawler;
+	ckdu_worker * const workers = malloc(worker_count * sizeof(ckdu_worker));
+	ckdu_crawl_job * const root_job = malloc(sizeof(ckdu_crawl_job));
+	unsigned int i = 0;
+
+	crawler.deques = malloc(worker_count * sizeof(ckdu_deque));
+	if (!workers || !root_job || !crawler.deques) {
+		handle_out_of_memory();
+	}
+	crawler.worker_count = worker_count;
+	crawler.tree = tree;
+	crawler.root_dirname = dirname;
+	crawler.root_fd = dir_fd;
+	crawler.options = options;
+	crawler.previous = previous;
+	crawler.shared_below = NULL;
+	crawler.inode_set = inode_set;
+	pthread_mutex_init(&crawler.pool_lock, NULL);
+	pthread_mutex_init(&crawler.stream_lock, NULL);
+	pthread_mutex_init(&crawler.idle_lock, NULL);
+	pthread_cond_init(&crawler.idle_cond, NULL);
+	crawler.queued = 0;
+	crawler.outstanding = 0;
+	crawler.sleeping = 0;
+
+	if (previous) {
+		uint32_t k = 0;
+		crawler.shared_below = calloc_or_die(previous->count, sizeof(bool));
+		for (; k < previous->shared_dir_count; k++) {
+			ckdu_index dir = previous->shared_dirs[k];
+			for (; (dir != CKDU_NO_INDEX) && !crawler.shared_below[dir]; dir = CKDU_AT(previous->parent, dir)) {
+				crawler.shared_below[dir] = true;
+			}
+		}
+	}
+
+	for (; i < worker_count; i++) {
+		pthread_mutex_init(&crawler.deques[i].lock, NULL);
+		crawler.deques[i].jobs = NULL;
+		crawler.deques[i].head = 0;
+		crawler.deques[i].tail = 0;
+		crawler.deques[i].capacity = 0;
+
+		workers[i].crawler = &crawler;
+		workers[i].index = i;
+		workers[i].names.next = 0;
+		workers[i].names.end = 0;
+		workers[i].has_last_device = false;
+		workers[i].ring = NULL;
+		workers[i].slots = NULL;
+		workers[i].free_slots = NULL;
+		workers[i].slot_count = 0;
+
+		workers[i].reader.buffer = malloc(CKDU_DIR_BUFFER_SIZE);
+		if (!workers[i].reader.buffer) {
+			handle_out_of_memory();
+		}
+		workers[i].reader.pos = 0;
+		workers[i].reader.len = 0;
+
+		workers[i].listing.records = NULL;
+		workers[i].listing.records_len = 0;
+		workers[i].listing.records_capacity = 0;
+		workers[i].listing.entries = NULL;
+		workers[i].listing.count = 0;
+		workers[i].listing.capacity = 0;
+		workers[i].listing.next = 0;
+
+		workers[i].staging.entries = NULL;
+		workers[i].staging.count = 0;
+		workers[i].staging.capacity = 0;
+		workers[i].staging.names = NULL;
+		workers[i].staging.names_len = 0;
+		workers[i].staging.names_capacity = 0;
+		workers[i].staging.files = NULL;
+		workers[i].staging.files_capacity = 0;
+
+		workers[i].previous_dirs = NULL;
+		workers[i].previous_dir_count = 0;
+		workers[i].previous_dirs_capacity = 0;
+		workers[i].adoptions = NULL;
+		workers[i].adoption_count = 0;
+		workers[i].adoptions_capacity = 0;
+
+		top_files_init(&workers[i].top_files, tree, options->top);
+		if (options->stream) {
+			output_init(&workers[i].stream, STDOUT_FILENO, false);
+			workers[i].stream.growing = true;
+			workers[i].stream.lock = &crawler.stream_lock;
+		} else {
+			/* Never written to, and empty until then */
+			output_init_memory(&workers[i].stream, false);
+		}
+	}
+
+	if (options->engine == CKDU_ENGINE_URING) {
+		for (i = 0; i < worker_count; i++) {
+			if (setup_uring_worker(workers + i, options->queue_depth)) {
+				fprintf(stderr, "Warning: io_uring not available (%s), "
+						"falling back to synchronous system calls.\n", strerror(errno));
+				while (i-- > 0) {
+					teardown_uring_worker(workers + i);
+					workers[i].ring = NULL;
+				}
+				break;
+			}
+		}
+	}
+
+	crawler.preopen_budget = raise_file_limit() / 4;
+	claim_inode(&crawler, tree->devices[CKDU_AT(tree->device, virtual_root)],
+			CKDU_AT(tree->inode, virtual_root), virtual_root);
+
+	root_job->node = virtual_root;
+	root_job->name = NULL;
+	root_job->depth = 0;
+	root_job->parent = NULL;
+	root_job->fd = -1;
+	root_job->dir_fd = -1;
+	root_job->dir_users = 1;
+	root_job->pending = 1;
+	root_job->shallow = false;
+	root_job->previous = previous ? previous_root : CKDU_NO_INDEX;
+	root_job->unchanged = previous
+			&& (CKDU_AT(previous->mtime, previous_root) == CKDU_AT(tree->mtime, virtual_root))
+			&& (CKDU_AT(previous->ctime, previous_root) == CKDU_AT(tree->ctime, virtual_root));
+	root_job->own_size = CKDU_AT(tree->content_size, virtual_root);
+	root_job->content_below = 0;
+	push_job(workers, root_job);
+
+	/* The calling thread is worker zero */
+	for (i = 1; i < worker_count; i++) {
+		if (pthread_create(&workers[i].thread, NULL, run_worker, workers + i)) {
+			/* Fewer threads just means less speed */
+			break;
+		}
+	}
+	run_worker(workers);
+	while (--i > 0) {
+		pthread_join(workers[i].thread, NULL);
+	}
+
+	resolve_shared_inodes(&crawler);
+	tree_sort_shared_dirs(tree);
+	free(crawler.shared_below);
+
+	for (i = 0; i < worker_count; i++) {
+		teardown_uring_worker(workers + i);
+		free(workers[i].reader.buffer);
+		free(workers[i].listing.records);
+		free(workers[i].listing.entries);
+		free(workers[i].staging.entries);
+		free(workers[i].staging.names);
+		free(workers[i].staging.files);
+		free(workers[i].previous_dirs);
+		free(workers[i].adoptions);
+		if (top_files) {
+			ckdu_top_files const * const found = &workers[i].top_files;
+			size_t k = 0;
+			for (; k < found->count; k++) {
+				top_files_offer(top_files, found->files[k].dir,
+						found->files[k].content_size, found->files[k].name);
+			}
+		}
+		top_files_release(&workers[i].top_files);
+		output_release(&workers[i].stream);
+		pthread_mutex_destroy(&crawler.deques[i].lock);
+		free(crawler.deques[i].jobs);
+	}
+	pthread_cond_destroy(&crawler.idle_cond);
+	pthread_mutex_destroy(&crawler.idle_lock);
+	pthread_mutex_destroy(&crawler.stream_lock);
+	pthread_mutex_destroy(&crawler.pool_lock);
+	free(crawler.deques);
+	free(workers);
+}
+
+typedef struct _ckdu_children {
+	/* Listed ones first, in order */
+	ckdu_index *indices;
+	size_t shown;
+
+	/* Everything beyond --max-entries and below the thresholds */
+	unsigned long other_count;
+	off_t other_size;
+} ckdu_children;
+
+void list_children(ckdu_tree const *tree, ckdu_index parent,
+		ckdu_options const *options, ckdu_children *children) {
+	/* Same pick for every output format */
+	uint32_t const child_count = CKDU_AT(tree->child_count, parent);
+	off_t const bytes_content = CKDU_AT(tree->total_size, parent);
+	size_t const limit = options->max_entries ? options->max_entries : child_count;
+	off_t const relative = (off_t)(options->threshold_percent / 100.0 * (double)bytes_content);
+	off_t const min_size = (relative > options->threshold) ? relative : options->threshold;
+	size_t i;
+
+	children->indices = malloc_sorted_children(tree, parent, limit, min_size, &children->shown);
+	if (!children->indices) {
+		handle_out_of_memory();
+	}
+
+	children->other_count = child_count - children->shown;
+	children->other_size = 0;
+	if (tree->other_buckets) {
+		children->other_count += CKDU_AT(tree->other_count, parent);
+		children->other_size += CKDU_AT(tree->other_size, parent);
+	}
+	for (i = children->shown; i < child_count; i++) {
+		children->other_size += CKDU_AT(tree->total_size, children->indices[i]);
+	}
+}
+
+void present_other_entries(ckdu_output *output, unsigned long count, off_t bytes_content, size_t indent_len) {
+	/* One line for everything beyond --max-entries */
+	output_size(output, bytes_content);
+	output_indent(output, indent_len);
+	output_string(output, " (");
+	output_unsigned(output, count);
+	output_string(output, (count == 1) ? " other entry)\n" : " other entries)\n");
+}
+
+bool has_children_listed(ckdu_tree const *tree, ckdu_index index, ckdu_options const *options) {
+	/* Boring folders the crawler did not look inside may well have something */
+	mode_t const mode = CKDU_AT(tree->mode, index);
+	return is_nonlink_dir(mode)
+		&& (CKDU_AT(tree->child_count, index)
+			|| (tree->other_buckets && CKDU_AT(tree->other_count, index))
+			|| ((options->boring_mode != CKDU_BORING_FULL)
+				&& is_boring_folder(tree_name(tree, index), options)));
+}
+
+char const * color_of_mode(mode_t mode) {
+	return is_nonlink_dir(mode)
+		? COLOR_BOLD_BLUE
+		: (is_symlink(mode)
+			? COLOR_BOLD_CYAN
+			: (is_executable_anybody(mode)
+				? COLOR_BOLD_GREEN
+				: ""));
+}
+
+void present_entry_line(ckdu_output *output, ckdu_tree *tree, ckdu_index index, size_t indent_len) {
+	mode_t const mode = CKDU_AT(tree->mode, index);
+
+	output_size(output, CKDU_AT(tree->total_size, index));
+	output_indent(output, indent_len + 1);
+	output_color(output, color_of_mode(mode));
+	output_string(output, tree_name(tree, index));
+	if (is_nonlink_dir(mode)) {
+		output_bytes(output, "/", 1);
+	}
+	output_color(output, COLOR_RESET);
+	if (is_symlink(mode)) {
+		output_string(output, " -> ");
+		output_string(output, tree_link_target(tree, index));
+	}
+
+	if (tree->file_aggregates && is_nonlink_dir(mode) && CKDU_AT(tree->file_count, index)) {
+		uint32_t const file_count = CKDU_AT(tree->file_count, index);
+		output_string(output, "  (");
+		output_unsigned(output, file_count);
+		output_string(output, (file_count == 1) ? " file, " : " files, ");
+		output_trimmed_size(output, CKDU_AT(tree->file_size, index));
+		output_string(output, ", largest ");
+		output_trimmed_size(output, CKDU_AT(tree->largest_file, index));
+		output_bytes(output, ")", 1);
+	}
+	output_bytes(output, "\n", 1);
+}
+
+void present_tree_indent(ckdu_output *output, ckdu_tree *tree, ckdu_index index,
+		size_t indent_len, ckdu_options const *options) {
+	size_t const child_indent_len = indent_len + 2;
+
+	present_entry_line(output, tree, index, indent_len);
+	if (!has_children_listed(tree, index, options)) {
+		return;
+	}
+
+	/* List children, two spaces of indentation per level */
+	if (is_boring_folder(tree_name(tree, index), options)) {
+		output_string(output, "      ...");
+		output_indent(output, child_indent_len + 1);
+		output_string(output, "...\n");
+	} else if (indent_len / 2 < options->max_depth) {
+		ckdu_children children;
+		size_t i = 0;
+
+		list_children(tree, index, options, &children);
+		for (; i < children.shown; i++) {
+			present_tree_indent(output, tree, children.indices[i], child_indent_len, options);
+		}
+		if (children.other_count) {
+			present_other_entries(output, children.other_count, children.other_size, child_indent_len);
+		}
+		free(children.indices);
+	}
+}
+
+enum ckdu_render_kind {
+	CKDU_RENDER_SUBTREE,
+	CKDU_RENDER_LINE,  /* Just the entry, its children are tasks of their own */
+	CKDU_RENDER_OTHER
+};
+
+typedef struct _ckdu_render_task {
+	enum ckdu_render_kind kind;
+	ckdu_index index;
+	size_t indent_len;
+	unsigned long other_count;
+	off_t other_size;
+
+	ckdu_output output;
+	bool done;
+} ckdu_render_task;
+
+typedef struct _ckdu_renderer {
+	/* Tasks are in output order, threads take them in that order too */
+	ckdu_tree *tree;
+	ckdu_options const *options;
+	ckdu_render_task *tasks;
+	size_t count;
+	size_t next;
+
+	pthread_mutex_t lock;
+	pthread_cond_t done_cond;
+} ckdu_renderer;
+
+size_t split_render_tasks(ckdu_renderer *renderer, size_t target) {
+	/* Replaces subtrees by their own line plus their children as
+	 * subtrees, level by level, until there is enough to go around */
+	ckdu_tree const * const tree = renderer->tree;
+	size_t subtree_count = 1;
+	bool split = true;
+
+	while (split && (subtree_count < target)) {
+		ckdu_render_task *tasks = NULL;
+		size_t count = 0;
+		size_t capacity = 0;
+		size_t i = 0;
+
+		split = false;
+		subtree_count = 0;
+		for (; i < renderer->count; i++) {
+			ckdu_render_task const * const task = renderer->tasks + i;
+			bool const expand = (task->kind == CKDU_RENDER_SUBTREE)
+				&& has_children_listed(tree, task->index, renderer->options)
+				&& !is_boring_folder(tree_name(tree, task->index), renderer->options)
+				&& (task->indent_len / 2 < renderer->options->max_depth);
+			ckdu_children children;
+			size_t k = 0;
+
+			children.shown = 0;
+			children.other_count = 0;
+			if (expand) {
+				list_children(tree, task->index, renderer->options, &children);
+			}
+			if (count + children.shown + 2 > capacity) {
+				capacity = 2 * (count + children.shown + 2);
+				tasks = realloc(tasks, capacity * sizeof(ckdu_render_task));
+				if (!tasks) {
+					handle_out_of_memory();
+				}
+			}
+
+			tasks[count] = *task;
+			if (!expand) {
+				subtree_count += (task->kind == CKDU_RENDER_SUBTREE);
+				count++;
+				continue;
+			}
+
+			tasks[count++].kind = CKDU_RENDER_LINE;
+			for (; k < children.shown; k++) {
+				tasks[count].kind = CKDU_RENDER_SUBTREE;
+				tasks[count].index = children.indices[k];
+				tasks[count].indent_len = task->indent_len + 2;
+				count++;
+			}
+			if (children.other_count) {
+				tasks[count].kind = CKDU_RENDER_OTHER;
+				tasks[count].indent_len = task->indent_len + 2;
+				tasks[count].other_count = children.other_count;
+				tasks[count].other_size = children.other_size;
+				count++;
+			}
+			subtree_count += children.shown;
+			free(children.indices);
+			split = true;
+		}
+
+		free(renderer->tasks);
+		renderer->tasks = tasks;
+		renderer->count = count;
+	}
+	return subtree_count;
+}
+
+void * run_renderer(void *void_renderer) {
+	ckdu_renderer * const renderer = (ckdu_renderer *)void_renderer;
+
+	for (;;) {
+		size_t const i = __sync_fetch_and_add(&renderer->next, 1);
+		ckdu_render_task *task;
+		ckdu_output *output;
+
+		if (i >= renderer->count) {
+			break;
+		}
+		task = renderer->tasks + i;
+		output = &task->output;
+
+		switch (task->kind) {
+		case CKDU_RENDER_SUBTREE:
+			present_tree_indent(output, renderer->tree, task->index, task->indent_len, renderer->options);
+			break;
+		case CKDU_RENDER_LINE:
+			present_entry_line(output, renderer->tree, task->index, task->indent_len);
+			break;
+		case CKDU_RENDER_OTHER:
+			present_other_entries(output, task->other_count, task->other_size, task->indent_len);
+			break;
+		}
+
+		pthread_mutex_lock(&renderer->lock);
+		task->done = true;
+		pthread_cond_broadcast(&renderer->done_cond);
+		pthread_mutex_unlock(&renderer->lock);
+	}
+
+	return NULL;
+}
+
+void present_tree(ckdu_output *output, ckdu_tree *tree, ckdu_index virtual_root, ckdu_options const *options) {
+	/* Threads render parts of the tree into buffers of their own,
+	 * the calling thread writes the buffers out in order */
+	unsigned int const thread_count = options->jobs;
+	pthread_t * const threads = malloc_or_die(thread_count * sizeof(pthread_t));
+	ckdu_renderer renderer;
+	unsigned int started = 0;
+	size_t i = 0;
+
+	renderer.tree = tree;
+	renderer.options = options;
+	renderer.tasks = malloc_or_die(sizeof(ckdu_render_task));
+	renderer.tasks[0].kind = CKDU_RENDER_SUBTREE;
+	renderer.tasks[0].index = virtual_root;
+	renderer.tasks[0].indent_len = 0;
+	renderer.count = 1;
+	renderer.next = 0;
+
+	if ((thread_count < 2) || (split_render_tasks(&renderer, 16 * thread_count) < 2)) {
+		present_tree_indent(output, tree, virtual_root, 0, options);
+		free(renderer.tasks);
+		free(threads);
+		return;
+	}
+
+	pthread_mutex_init(&renderer.lock, NULL);
+	pthread_cond_init(&renderer.done_cond, NULL);
+	for (; i < renderer.count; i++) {
+		output_init_memory(&renderer.tasks[i].output, output->color);
+		renderer.tasks[i].done = false;
+	}
+	for (; started < thread_count; started++) {
+		if (pthread_create(threads + started, NULL, run_renderer, &renderer)) {
+			break;
+		}
+	}
+	if (!started) {
+		/* No threads, no problem */
+		run_renderer(&renderer);
+	}
+
+	for (i = 0; i < renderer.count; i++) {
+		ckdu_render_task * const task = renderer.tasks + i;
+
+		pthread_mutex_lock(&renderer.lock);
+		while (!task->done) {
+			pthread_cond_wait(&renderer.done_cond, &renderer.lock);
+		}
+		pthread_mutex_unlock(&renderer.lock);
+
+		output_bytes(output, task->output.buffer, task->output.len);
+		free(task->output.buffer);
+		free(task->output.spaces);
+	}
+
+	while (started-- > 0) {
+		pthread_join(threads[started], NULL);
+	}
+	pthread_cond_destroy(&renderer.done_cond);
+	pthread_mutex_destroy(&renderer.lock);
+	free(renderer.tasks);
+	free(threads);
+}
+
+int compare_dirs_by_size(const void *void_a, const void *void_b, void *void_tree) {
+	ckdu_tree const * const tree = (ckdu_tree const *)void_tree;
+	ckdu_index const a = *(ckdu_index const *)void_a;
+	ckdu_index const b = *(ckdu_index const *)void_b;
+	off_t const a_size = CKDU_AT(tree->total_size, a);
+	off_t const b_size = CKDU_AT(tree->total_size, b);
+
+	if (a_size != b_size) {
+		return (a_size < b_size) ? 1 : -1;
+	}
+	return compare_trees_path_wise(tree, a, b);
+}
+
+void present_top_entry(ckdu_output *output, ckdu_tree const *tree, char const *root_dirname,
+		ckdu_index dir, off_t bytes_content, char const *name) {
+	char * const path = malloc_tree_path(root_dirname, tree, dir);
+
+	if (!path) {
+		handle_out_of_memory();
+	}
+	output_size(output, bytes_content);
+	output_bytes(output, " ", 1);
+	output_string(output, path);
+	output_bytes(output, "/", 1);
+	output_string(output, name);
+	output_bytes(output, "\n", 1);
+	free(path);
+}
+
+void present_top(ckdu_output *output, ckdu_tree const *tree, ckdu_index virtual_root,
+		ckdu_top_files *top_files, char const *root_dirname) {
+	/* Directories are few compared to files, all of
+	 * them are in the tree and only need picking */
+	size_t const dir_count = tree->count - virtual_root - 1;
+	ckdu_index * const dirs = malloc_or_die((dir_count + 1) * sizeof(ckdu_index));
+	size_t shown;
+	size_t i = 0;
+
+	qsort_r(top_files->heap, top_files->count, sizeof(ckdu_index), compare_top_files, top_files);
+	output_string(output, "Largest files:\n");
+	for (; i < top_files->count; i++) {
+		ckdu_top_file const * const file = top_files->files + top_files->heap[i];
+		present_top_entry(output, tree, root_dirname, file->dir, file->content_size, file->name);
+	}
+
+	for (i = 0; i < dir_count; i++) {
+		dirs[i] = virtual_root + 1 + i;
+	}
+	shown = select_first(dirs, dir_count, top_files->limit, compare_dirs_by_size, (void *)tree);
+	output_string(output, "Largest directories:\n");
+	for (i = 0; i < shown; i++) {
+		present_top_entry(output, tree, root_dirname, CKDU_AT(tree->parent, dirs[i]),
+				CKDU_AT(tree->total_size, dirs[i]), tree_name(tree, dirs[i]));
+	}
+	free(dirs);
+}
+
+void present_json_entry(ckdu_output *output, ckdu_tree *tree, ckdu_index index,
+		unsigned int depth, ckdu_options const *options) {
+	mode_t const mode = CKDU_AT(tree->mode, index);
+	char const * const name = tree_name(tree, index);
+
+	output_string(output, "{\"name\":");
+	output_json_string(output, name);
+	output_json_number(output, "size", (uint64_t)CKDU_AT(tree->total_size, index));
+	output_json_number(output, "own_size", (uint64_t)CKDU_AT(tree->content_size, index));
+	output_json_number(output, "mode", mode);
+	output_json_number(output, "inode", CKDU_AT(tree->inode, index));
+	output_json_number(output, "device", tree->devices[CKDU_AT(tree->device, index)]);
+	if (is_symlink(mode)) {
+		output_string(output, ",\"target\":");
+		output_json_string(output, tree_link_target(tree, index));
+	}
+
+	if (is_nonlink_dir(mode)) {
+		if (tree->file_aggregates) {
+			output_json_number(output, "files", CKDU_AT(tree->file_count, index));
+			output_json_number(output, "file_size", (uint64_t)CKDU_AT(tree->file_size, index));
+			output_json_number(output, "largest_file", (uint64_t)CKDU_AT(tree->largest_file, index));
+		}
+		if (is_boring_folder(name, options)) {
+			output_string(output, ",\"boring\":true");
+		} else {
+			ckdu_children children;
+			size_t i = 0;
+
+			children.indices = NULL;
+			children.shown = 0;
+			children.other_count = 0;
+			if (depth < options->max_depth) {
+				list_children(tree, index, options, &children);
+			}
+			output_string(output, ",\"children\":[");
+			for (; i < children.shown; i++) {
+				if (i) {
+					output_bytes(output, ",", 1);
+				}
+				present_json_entry(output, tree, children.indices[i], depth + 1, options);
+			}
+			output_bytes(output, "]", 1);
+			if (children.other_count) {
+				output_json_number(output, "other_entries", children.other_count);
+				output_json_number(output, "other_size", (uint64_t)children.other_size);
+			}
+			free(children.indices);
+		}
+	}
+	output_bytes(output, "}", 1);
+}
+
+void output_csv_field(ckdu_output *output, char const *text, size_t len) {
+	/* Quoted only where needed, as of RFC 4180 */
+	char const *quote;
+
+	if (!memchr(text, ',', len) && !memchr(text, '"', len)
+			&& !memchr(text, '\n', len) && !memchr(text, '\r', len)) {
+		output_bytes(output, text, len);
+		return;
+	}
+
+	output_bytes(output, "\"", 1);
+	while ((quote = memchr(text, '"', len)) != NULL) {
+		output_bytes(output, text, quote - text + 1);
+		output_bytes(output, "\"", 1);
+		len -= quote - text + 1;
+		text = quote + 1;
+	}
+	output_bytes(output, text, len);
+	output_bytes(output, "\"", 1);
+}
+
+void output_csv_number(ckdu_output *output, uint64_t number) {
+	output_bytes(output, ",", 1);
+	output_unsigned(output, number);
+}
+
+typedef struct _ckdu_csv_path {
+	char *text;
+	size_t len;
+	size_t capacity;
+} ckdu_csv_path;
+
+void present_csv_entry(ckdu_output *output, ckdu_tree *tree, ckdu_index index,
+		ckdu_csv_path *path, unsigned int depth, ckdu_options const *options) {
+	/* One row per entry, with the path built up in place */
+	mode_t const mode = CKDU_AT(tree->mode, index);
+	char const * const name = tree_name(tree, index);
+	size_t const parent_len = path->len;
+	size_t const name_len = strlen(name);
+	bool const boring = is_nonlink_dir(mode) && is_boring_folder(name, options);
+	bool const listed = is_nonlink_dir(mode) && !boring && (depth < options->max_depth);
+	ckdu_children children;
+	size_t i = 0;
+
+	if (parent_len + 1 + name_len > path->capacity) {
+		size_t const capacity = 2 * (parent_len + 1 + name_len);
+		char * const text = realloc(path->text, capacity);
+		if (!text) {
+			handle_out_of_memory();
+		}
+		path->text = text;
+		path->capacity = capacity;
+	}
+	if (CKDU_AT(tree->parent, index) != CKDU_NO_INDEX) {
+		path->text[path->len++] = '/';
+		memcpy(path->text + path->len, name, name_len);
+		path->len += name_len;
+	}
+
+	children.shown = 0;
+	children.other_count = 0;
+	children.other_size = 0;
+	if (listed) {
+		list_children(tree, index, options, &children);
+	}
+
+	output_csv_field(output, path->text, path->len);
+	output_csv_number(output, (uint64_t)CKDU_AT(tree->total_size, index));
+	output_csv_number(output, (uint64_t)CKDU_AT(tree->content_size, index));
+	output_csv_number(output, mode);
+	output_csv_number(output, CKDU_AT(tree->inode, index));
+	output_csv_number(output, tree->devices[CKDU_AT(tree->device, index)]);
+	output_csv_number(output, boring);
+	if (tree->file_aggregates && is_nonlink_dir(mode)) {
+		output_csv_number(output, CKDU_AT(tree->file_count, index));
+		output_csv_number(output, (uint64_t)CKDU_AT(tree->file_size, index));
+		output_csv_number(output, (uint64_t)CKDU_AT(tree->largest_file, index));
+	} else {
+		output_string(output, ",0,0,0");
+	}
+	output_csv_number(output, children.other_count);
+	output_csv_number(output, (uint64_t)children.other_size);
+	output_bytes(output, ",", 1);
+	if (is_symlink(mode)) {
+		char const * const target = tree_link_target(tree, index);
+		output_csv_field(output, target, strlen(target));
+	}
+	output_bytes(output, "\r\n", 2);
+
+	if (listed) {
+		for (; i < children.shown; i++) {
+			present_csv_entry(output, tree, children.indices[i], path, depth + 1, options);
+		}
+		free(children.indices);
+	}
+	path->len = parent_len;
+}
+
+void present_csv(ckdu_output *output, ckdu_tree *tree, ckdu_index virtual_root,
+		char const *root_dirname, ckdu_options const *options) {
+	ckdu_csv_path path;
+
+	path.len = strlen(root_dirname);
+	path.capacity = 2 * path.len + 256;
+	path.text = malloc_or_die(path.capacity);
+	memcpy(path.text, root_dirname, path.len);
+
+	output_string(output, "path,size,own_size,mode,inode,device,boring,"
+			"files,file_size,largest_file,other_entries,other_size,target\r\n");
+	present_csv_entry(output, tree, virtual_root, &path, 0, options);
+	free(path.text);
+}
+
+/* Layout of --format=bin, all numbers little-endian:
+ *
+ *   Header, CKDU_BIN_HEADER_SIZE bytes
+ *     0  magic "CKDUTREE"
+ *     8  uint32 version, 1
+ *    12  uint32 record size, CKDU_BIN_RECORD_SIZE
+ *    16  uint64 number of records
+ *    24  uint64 file offset of the names
+ *    32  uint64 size of the names in bytes
+ *    40  reserved, zero
+ *
+ *   Records, one per entry, breadth first so that the children of an
+ *   entry are next to each other in listing order; the root is record 0
+ *     0  uint64 size, including everything below
+ *     8  uint64 own size
+ *    16  uint64 inode
+ *    24  uint64 device
+ *    32  uint64 name, offset into the names
+ *    40  uint64 symlink target, offset into the names, or all ones
+ *    48  uint64 size of other entries
+ *    56  uint64 size of files right inside (--dirs-only)
+ *    64  uint64 size of the largest file right inside (--dirs-only)
+ *    72  uint32 mode
+ *    76  uint32 parent record, or all ones for the root
+ *    80  uint32 first child record
+ *    84  uint32 number of child records
+ *    88  uint32 number of other entries
+ *    92  uint32 number of files right inside (--dirs-only)
+ *    96  uint32 flags, 1 for boring folders with children left out
+ *   100  reserved, zero
+ *
+ *   Names, each terminated by a zero byte
+ */
+#define CKDU_BIN_HEADER_SIZE 64
+#define CKDU_BIN_RECORD_SIZE 104
+#define CKDU_BIN_NO_LINK ((uint64_t)-1)
+
+typedef struct _ckdu_bin_node {
+	ckdu_index index;
+	uint32_t parent;
+	uint32_t first_child;
+	uint32_t child_count;
+	uint32_t other_count;
+	uint32_t flags;
+	off_t other_size;
+	unsigned int depth;
+} ckdu_bin_node;
+
+void put_u32(unsigned char *target, uint32_t number) {
+	unsigned int i = 0;
+	for (; i < 4; i++) {
+		target[i] = (unsigned char)(number >> (8 * i));
+	}
+}
+
+void put_u64(unsigned char *target, uint64_t number) {
+	unsigned int i = 0;
+	for (; i < 8; i++) {
+		target[i] = (unsigned char)(number >> (8 * i));
+	}
+}
+
+void present_bin(ckdu_output *output, ckdu_tree *tree, ckdu_index virtual_root, ckdu_options const *options) {
+	/* Numbers records breadth first, then writes them in one go */
+	size_t capacity = 1024;
+	size_t count = 1;
+	size_t done = 0;
+	ckdu_bin_node *nodes = malloc_or_die(capacity * sizeof(ckdu_bin_node));
+	unsigned char header[CKDU_BIN_HEADER_SIZE];
+	unsigned char record[CKDU_BIN_RECORD_SIZE];
+	uint64_t names_size = 0;
+	size_t i;
+
+	nodes[0].index = virtual_root;
+	nodes[0].parent = CKDU_NO_INDEX;
+	nodes[0].depth = 0;
+	for (; done < count; done++) {
+		ckdu_bin_node * const node = nodes + done;
+		mode_t const mode = CKDU_AT(tree->mode, node->index);
+		char const * const name = tree_name(tree, node->index);
+
+		node->first_child = (uint32_t)count;
+		node->child_count = 0;
+		node->other_count = 0;
+		node->other_size = 0;
+		node->flags = 0;
+		names_size += strlen(name) + 1;
+		if (is_symlink(mode)) {
+			names_size += strlen(tree_link_target(tree, node->index)) + 1;
+		}
+		if (!is_nonlink_dir(mode)) {
+			continue;
+		}
+		if (is_boring_folder(name, options)) {
+			node->flags = 1;
+		} else if (node->depth < options->max_depth) {
+			ckdu_children children;
+			list_children(tree, node->index, options, &children);
+			if (count + children.shown > capacity) {
+				ckdu_bin_node *grown;
+				capacity = 2 * (count + children.shown);
+				grown = realloc(nodes, capacity * sizeof(ckdu_bin_node));
+				if (!grown) {
+					handle_out_of_memory();
+				}
+				nodes = grown;
+			}
+			for (i = 0; i < children.shown; i++) {
+				nodes[count + i].index = children.indices[i];
+				nodes[count + i].parent = (uint32_t)done;
+				nodes[count + i].depth = nodes[done].depth + 1;
+			}
+			nodes[done].child_count = (uint32_t)children.shown;
+			nodes[done].other_count = (uint32_t)children.other_count;
+			nodes[done].other_size = children.other_size;
+			count += children.shown;
+			free(children.indices);
+		}
+	}
+
+	memset(header, 0, sizeof(header));
+	memcpy(header, "CKDUTREE", 8);
+	put_u32(header + 8, 1);
+	put_u32(header + 12, CKDU_BIN_RECORD_SIZE);
+	put_u64(header + 16, count);
+	put_u64(header + 24, CKDU_BIN_HEADER_SIZE + (uint64_t)count * CKDU_BIN_RECORD_SIZE);
+	put_u64(header + 32, names_size);
+	output_bytes(output, (char const *)header, sizeof(header));
+
+	names_size = 0;
+	memset(record, 0, sizeof(record));
+	for (i = 0; i < count; i++) {
+		ckdu_bin_node const * const node = nodes + i;
+		ckdu_index const index = node->index;
+		mode_t const mode = CKDU_AT(tree->mode, index);
+		bool const aggregates = tree->file_aggregates && is_nonlink_dir(mode);
+
+		put_u64(record, (uint64_t)CKDU_AT(tree->total_size, index));
+		put_u64(record + 8, (uint64_t)CKDU_AT(tree->content_size, index));
+		put_u64(record + 16, CKDU_AT(tree->inode, index));
+		put_u64(record + 24, tree->devices[CKDU_AT(tree->device, index)]);
+		put_u64(record + 32, names_size);
+		names_size += strlen(tree_name(tree, index)) + 1;
+		if (is_symlink(mode)) {
+			put_u64(record + 40, names_size);
+			names_size += strlen(tree_link_target(tree, index)) + 1;
+		} else {
+			put_u64(record + 40, CKDU_BIN_NO_LINK);
+		}
+		put_u64(record + 48, (uint64_t)node->other_size);
+		put_u64(record + 56, aggregates ? (uint64_t)CKDU_AT(tree->file_size, index) : 0);
+		put_u64(record + 64, aggregates ? (uint64_t)CKDU_AT(tree->largest_file, index) : 0);
+		put_u32(record + 72, mode);
+		put_u32(record + 76, node->parent);
+		put_u32(record + 80, node->first_child);
+		put_u32(record + 84, node->child_count);
+		put_u32(record + 88, node->other_count);
+		put_u32(record + 92, aggregates ? CKDU_AT(tree->file_count, index) : 0);
+		put_u32(record + 96, node->flags);
+		output_bytes(output, (char const *)record, sizeof(record));
+	}
+
+	for (i = 0; i < count; i++) {
+		ckdu_index const index = nodes[i].index;
+		char const * const name = tree_name(tree, index);
+		output_bytes(output, name, strlen(name) + 1);
+		if (is_symlink(CKDU_AT(tree->mode, index))) {
+			char const * const target = tree_link_target(tree, index);
+			output_bytes(output, target, strlen(target) + 1);
+		}
+	}
+
+	free(nodes);
+}
+
+void present_formatted(ckdu_output *output, ckdu_tree *tree, ckdu_index virtual_root,
+		char const *root_dirname, ckdu_options const *options) {
+	switch (options->format) {
+	case CKDU_FORMAT_TREE:
+		present_tree(output, tree, virtual_root, options);
+		break;
+	case CKDU_FORMAT_JSON:
+		present_json_entry(output, tree, virtual_root, 0, options);
+		output_bytes(output, "\n", 1);
+		break;
+	case CKDU_FORMAT_CSV:
+		present_csv(output, tree, virtual_root, root_dirname, options);
+		break;
+	case CKDU_FORMAT_BIN:
+		present_bin(output, tree, virtual_root, options);
+		break;
+	}
+}
+
+/* With --diff, the tree loaded is compared with an earlier snapshot.
+ * Both trees are walked together, breadth first, merging the children
+ * of each directory in name order. Directories found in both get a
+ * node each. Files get a node only when their size differs, and
+ * entries found in one tree only get one for the whole subtree. New
+ * and deleted entries are then added up from the bottom. Unchanged
+ * parts are left out on output, the rest is sorted by size of change. */
+typedef struct _ckdu_diff_node {
+	ckdu_index before;  /* CKDU_NO_INDEX for new entries */
+	ckdu_index after;  /* CKDU_NO_INDEX for deleted entries */
+	int64_t change;  /* In bytes, including everything below */
+
+	/* Entries at or below this one */
+	unsigned long new_count;
+	unsigned long deleted_count;
+	bool changed;
+
+	ckdu_index parent;
+	ckdu_index first_child;
+	ckdu_index child_count;
+} ckdu_diff_node;
+
+typedef struct _ckdu_diff {
+	ckdu_tree const *before;
+	ckdu_tree const *after;
+	ckdu_diff_node *nodes;
+	size_t count;
+	size_t capacity;
+} ckdu_diff;
+
+unsigned long count_entries(ckdu_tree const *tree, ckdu_index index) {
+	/* Depth first, going back up along the parents rather than
+	 * keeping a stack, however deep the tree */
+	unsigned long count = 1;
+	ckdu_index at = index;
+
+	for (;;) {
+		if (CKDU_AT(tree->child_count, at)) {
+			at = CKDU_AT(tree->first_child, at);
+			count++;
+			continue;
+		}
+		for (; at != index; at = CKDU_AT(tree->parent, at)) {
+			ckdu_index const parent = CKDU_AT(tree->parent, at);
+			if (at + 1 - CKDU_AT(tree->first_child, parent) < CKDU_AT(tree->child_count, parent)) {
+				break;
+			}
+		}
+		if (at == index) {
+			return count;
+		}
+		at++;
+		count++;
+	}
+}
+
+ckdu_index * malloc_children_by_name(ckdu_tree const *tree, ckdu_index dir) {
+	ckdu_index const first = CKDU_AT(tree->first_child, dir);
+	uint32_t const child_count = CKDU_AT(tree->child_count, dir);
+	ckdu_index * const children = malloc_or_die((child_count + 1) * sizeof(ckdu_index));
+	uint32_t i = 0;
+
+	for (; i < child_count; i++) {
+		children[i] = first + i;
+	}
+	qsort_r(children, child_count, sizeof(ckdu_index), compare_indices_by_name, (void *)tree);
+	return children;
+}
+
+void diff_add_node(ckdu_diff *diff, ckdu_index parent, ckdu_index before, ckdu_index after) {
+	ckdu_diff_node *node;
+
+	if (diff->count == diff->capacity) {
+		ckdu_diff_node *grown;
+		diff->capacity = diff->capacity ? 2 * diff->capacity : 1024;
+		grown = realloc(diff->nodes, diff->capacity * sizeof(ckdu_diff_node));
+		if (!grown) {
+			handle_out_of_memory();
+		}
+		diff->nodes = grown;
+	}
+
+	node = diff->nodes + diff->count++;
+	node->before = before;
+	node->after = after;
+	node->change = ((after != CKDU_NO_INDEX) ? (int64_t)CKDU_AT(diff->after->total_size, after) : 0)
+		- ((before != CKDU_NO_INDEX) ? (int64_t)CKDU_AT(diff->before->total_size, before) : 0);
+	node->new_count = (before == CKDU_NO_INDEX) ? count_entries(diff->after, after) : 0;
+	node->deleted_count = (after == CKDU_NO_INDEX) ? count_entries(diff->before, before) : 0;
+	node->changed = (node->change != 0) || node->new_count || node->deleted_count;
+	node->parent = parent;
+	node->first_child = (ckdu_index)diff->count;
+	node->child_count = 0;
+}
+
+void diff_trees(ckdu_diff *diff, ckdu_index before_root, ckdu_index after_root) {
+	ckdu_tree const * const before = diff->before;
+	ckdu_tree const * const after = diff->after;
+	size_t done = 0;
+	size_t i;
+
+	diff->nodes = NULL;
+	diff->count = 0;
+	diff->capacity = 0;
+	diff_add_node(diff, CKDU_NO_INDEX, before_root, after_root);
+
+	for (; done < diff->count; done++) {
+		ckdu_index const before_dir = diff->nodes[done].before;
+		ckdu_index const after_dir = diff->nodes[done].after;
+		ckdu_index const first = (ckdu_index)diff->count;
+		ckdu_index *before_children;
+		ckdu_index *after_children;
+		uint32_t before_count;
+		uint32_t after_count;
+		uint32_t b = 0;
+		uint32_t a = 0;
+
+		if ((before_dir == CKDU_NO_INDEX) || (after_dir == CKDU_NO_INDEX)
+				|| !is_nonlink_dir(CKDU_AT(before->mode, before_dir))) {
+			continue;
+		}
+
+		before_children = malloc_children_by_name(before, before_dir);
+		after_children = malloc_children_by_name(after, after_dir);
+		before_count = CKDU_AT(before->child_count, before_dir);
+		after_count = CKDU_AT(after->child_count, after_dir);
+		while ((b < before_count) || (a < after_count)) {
+			int const order = (b == before_count) ? 1
+				: ((a == after_count) ? -1
+					: strcmp(tree_name(before, before_children[b]), tree_name(after, after_children[a])));
+
+			if (order < 0) {
+				diff_add_node(diff, (ckdu_index)done, before_children[b++], CKDU_NO_INDEX);
+			} else if (order > 0) {
+				diff_add_node(diff, (ckdu_index)done, CKDU_NO_INDEX, after_children[a++]);
+			} else {
+				ckdu_index const was = before_children[b++];
+				ckdu_index const is = after_children[a++];
+				bool const was_dir = is_nonlink_dir(CKDU_AT(before->mode, was));
+
+				if (was_dir != is_nonlink_dir(CKDU_AT(after->mode, is))) {
+					/* Same name, different kind of entry */
+					diff_add_node(diff, (ckdu_index)done, was, CKDU_NO_INDEX);
+					diff_add_node(diff, (ckdu_index)done, CKDU_NO_INDEX, is);
+				} else if (was_dir || (CKDU_AT(before->total_size, was) != CKDU_AT(after->total_size, is))) {
+					diff_add_node(diff, (ckdu_index)done, was, is);
+				}
+			}
+		}
+		diff->nodes[done].first_child = first;
+		diff->nodes[done].child_count = (ckdu_index)diff->count - first;
+		free(before_children);
+		free(after_children);
+	}
+
+	/* Children come after their parents */
+	for (i = diff->count; i-- > 1;) {
+		ckdu_diff_node const * const node = diff->nodes + i;
+		ckdu_diff_node * const parent = diff->nodes + node->parent;
+		parent->new_count += node->new_count;
+		parent->deleted_count += node->deleted_count;
+		parent->changed = parent->changed || node->changed;
+	}
+}
+
+int64_t abs_change(int64_t change) {
+	return (change < 0) ? -change : change;
+}
+
+int compare_diff_nodes(const void *void_a, const void *void_b, void *void_diff) {
+	/* Biggest change first, growth before shrinking, then by name */
+	ckdu_diff const * const diff = (ckdu_diff const *)void_diff;
+	ckdu_diff_node const * const a = diff->nodes + *(ckdu_index const *)void_a;
+	ckdu_diff_node const * const b = diff->nodes + *(ckdu_index const *)void_b;
+	int64_t const a_size = abs_change(a->change);
+	int64_t const b_size = abs_change(b->change);
+
+	if (a_size != b_size) {
+		return (a_size < b_size) ? 1 : -1;
+	}
+	if ((a->change < 0) != (b->change < 0)) {
+		return (a->change < 0) ? 1 : -1;
+	}
+	return strcmp((a->after != CKDU_NO_INDEX) ? tree_name(diff->after, a->after) : tree_name(diff->before, a->before),
+			(b->after != CKDU_NO_INDEX) ? tree_name(diff->after, b->after) : tree_name(diff->before, b->before));
+}
+
+void output_change(ckdu_output *output, int64_t change) {
+	/* Like output_size, one column wider for the sign */
+	char size_display[CKDU_SIZE_DISPLAY_LEN + 2];
+	size_t const digit = 1 + strspn(format_size(size_display + 1, (off_t)abs_change(change)), " ");
+
+	size_display[0] = ' ';
+	if (change) {
+		size_display[digit - 1] = (change < 0) ? '-' : '+';
+	}
+	output_bytes(output, size_display, CKDU_SIZE_DISPLAY_LEN + 1);
+}
+
+void present_diff_line(ckdu_output *output, ckdu_diff const *diff, ckdu_diff_node const *node,
+		size_t indent_len) {
+	ckdu_tree const * const tree = (node->after != CKDU_NO_INDEX) ? diff->after : diff->before;
+	ckdu_index const index = (node->after != CKDU_NO_INDEX) ? node->after : node->before;
+	mode_t const mode = CKDU_AT(tree->mode, index);
+
+	output_change(output, node->change);
+	output_indent(output, indent_len + 1);
+	output_color(output, color_of_mode(mode));
+	output_string(output, tree_name(tree, index));
+	if (is_nonlink_dir(mode)) {
+		output_bytes(output, "/", 1);
+	}
+	output_color(output, COLOR_RESET);
+
+	if ((node->before == CKDU_NO_INDEX) || (node->after == CKDU_NO_INDEX)) {
+		unsigned long const count = node->new_count + node->deleted_count;
+		output_string(output, (node->before == CKDU_NO_INDEX) ? "  (new" : "  (deleted");
+		if (count > 1) {
+			output_string(output, ", ");
+			output_unsigned(output, count);
+			output_string(output, " entries");
+		}
+		output_bytes(output, ")", 1);
+	} else if (node->new_count || node->deleted_count) {
+		output_string(output, "  (");
+		if (node->new_count) {
+			output_unsigned(output, node->new_count);
+			output_string(output, node->deleted_count ? " new, " : " new");
+		}
+		if (node->deleted_count) {
+			output_unsigned(output, node->deleted_count);
+			output_string(output, " deleted");
+		}
+		output_bytes(output, ")", 1);
+	}
+	output_bytes(output, "\n", 1);
+}
+
+void present_diff_node(ckdu_output *output, ckdu_diff const *diff, ckdu_index id,
+		size_t indent_len, ckdu_options const *options) {
+	/* Same picks as list_children, by size of change */
+	ckdu_diff_node const * const node = diff->nodes + id;
+	int64_t const relative = (int64_t)(options->threshold_percent / 100.0 * (double)abs_change(node->change));
+	int64_t const min_size = (relative > options->threshold) ? relative : options->threshold;
+	ckdu_index *children;
+	unsigned long other_count = 0;
+	int64_t other_change = 0;
+	size_t shown;
+	size_t big_count = 0;
+	size_t i = 0;
+
+	present_diff_line(output, diff, node, indent_len);
+	if (!node->child_count || (indent_len / 2 >= options->max_depth)) {
+		return;
+	}
+
+	children = malloc_or_die(node->child_count * sizeof(ckdu_index));
+	for (; i < node->child_count; i++) {
+		ckdu_diff_node const * const child = diff->nodes + node->first_child + i;
+		if (!child->changed) {
+			continue;
+		}
+		if (abs_change(child->change) >= min_size) {
+			children[big_count++] = node->first_child + (ckdu_index)i;
+		} else {
+			other_count++;
+			other_change += child->change;
+		}
+	}
+	shown = select_first(children, big_count, options->max_entries ? options->max_entries : big_count,
+			compare_diff_nodes, (void *)diff);
+
+	for (i = 0; i < shown; i++) {
+		present_diff_node(output, diff, children[i], indent_len + 2, options);
+	}
+	for (; i < big_count; i++) {
+		other_count++;
+		other_change += diff->nodes[children[i]].change;
+	}
+	if (other_count) {
+		output_change(output, other_change);
+		output_indent(output, indent_len + 2);
+		output_string(output, " (");
+		output_unsigned(output, other_count);
+		output_string(output, (other_count == 1) ? " other entry changed)\n" : " other entries changed)\n");
+	}
+	free(children);
+}
+
+void present_diff(ckdu_output *output, ckdu_tree const *before, ckdu_index before_root,
+		ckdu_tree const *after, ckdu_index after_root, ckdu_options const *options) {
+	ckdu_diff diff;
+
+	diff.before = before;
+	diff.after = after;
+	diff_trees(&diff, before_root, after_root);
+	present_diff_node(output, &diff, 0, 0, options);
+	free(diff.nodes);
+}
+
+char const * const format_names[] = {"tree", "json", "csv", "bin"};
+
+int parse_format(char const *name, enum ckdu_format *format) {
+	size_t i = 0;
+
+	for (; i < sizeof(format_names) / sizeof(char *); i++) {
+		if (!strcmp(name, format_names[i])) {
+			*format = (enum ckdu_format)i;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/* With --listen, the tree answers queries on a Unix domain socket, one
+ * per connection. A query is a single line, one of
+ *
+ *   FORMAT size PATH
+ *   FORMAT top N PATH
+ *   FORMAT depth N PATH
+ *
+ * for the entry at PATH alone, its N biggest entries, or everything no
+ * more than N levels below it, with FORMAT as for --format. PATH is
+ * relative to the directory crawled, or absolute starting with it. The
+ * answer is a line "OK" and the output, or a line starting "Error: ".
+ * Paths are looked up one name at a time through an index of
+ * directory and name pairs. With --daemon, entries move around
+ * underneath the index, so every hit is checked against the tree, and
+ * misses are looked up among the siblings and added. Clients get
+ * CKDU_QUERY_TIMEOUT_SECONDS in all to send a query and take the answer,
+ * time spent on working out the answer aside. */
+#define CKDU_QUERY_SIZE 4096
+#define CKDU_QUERY_TIMEOUT_SECONDS 5
+
+typedef struct _ckdu_path_index {
+	/* Open addressing with linear probing, CKDU_NO_INDEX for free slots */
+	ckdu_index *slots;
+	size_t capacity;  /* Power of two */
+	size_t count;
+} ckdu_path_index;
+
+typedef struct _ckdu_server {
+	int listen_fd;
+	char const *socket_path;
+	ckdu_path_index index;
+
+	/* The starting point with symlinks resolved, so that absolute
+	 * paths in queries may get there some other way. NULL for
+	 * snapshots, which may have been taken anywhere. */
+	char *real_root;
+} ckdu_server;
+
+size_t hash_child_name(ckdu_index dir, char const *name) {
+	uint64_t const basis = ((uint64_t)0xCBF29CE4UL << 32) | 0x84222325UL;
+	return (size_t)hash_bytes(hash_bytes(basis, &dir, sizeof(dir)), name, strlen(name));
+}
+
+bool is_child_named(ckdu_tree const *tree, ckdu_index index, ckdu_index dir, char const *name) {
+	/* Left behind or moved elsewhere does not count */
+	ckdu_index first;
+
+	if ((index >= tree->count) || (CKDU_AT(tree->parent, index) != dir)) {
+		return false;
+	}
+	first = CKDU_AT(tree->first_child, dir);
+	return (index >= first) && (index - first < CKDU_AT(tree->child_count, dir))
+		&& !strcmp(tree_name(tree, index), name);
+}
+
+void path_index_insert(ckdu_path_index *index, ckdu_tree const *tree, ckdu_index child) {
+	ckdu_index const dir = CKDU_AT(tree->parent, child);
+	char const * const name = tree_name(tree, child);
+	size_t i = hash_child_name(dir, name) & (index->capacity - 1);
+
+	while (index->slots[i] != CKDU_NO_INDEX) {
+		if (is_child_named(tree, index->slots[i], dir, name)) {
+			return;
+		}
+		i = (i + 1) & (index->capacity - 1);
+	}
+	index->slots[i] = child;
+	index->count++;
+}
+
+void path_index_fill(ckdu_path_index *index, ckdu_tree const *tree, ckdu_index root) {
+	/* Starts over with everything below the root, depth first */
+	size_t capacity = 1024;
+	ckdu_index at = root;
+	size_t i = 0;
+
+	while (capacity < 2 * (size_t)tree->count) {
+		capacity *= 2;
+	}
+	if (capacity != index->capacity) {
+		free(index->slots);
+		index->slots = malloc_or_die(capacity * sizeof(ckdu_index));
+		index->capacity = capacity;
+	}
+	for (; i < capacity; i++) {
+		index->slots[i] = CKDU_NO_INDEX;
+	}
+	index->count = 0;
+
+	for (;;) {
+		if (CKDU_AT(tree->child_count, at)) {
+			at = CKDU_AT(tree->first_child, at);
+		} else {
+			/* Next sibling, or that of the closest parent with one */
+			while (at != root) {
+				ckdu_index const parent = CKDU_AT(tree->parent, at);
+				if (at + 1 < CKDU_AT(tree->first_child, parent) + CKDU_AT(tree->child_count, parent)) {
+					break;
+				}
+				at = parent;
+			}
+			if (at == root) {
+				break;
+			}
+			at++;
+		}
+		path_index_insert(index, tree, at);
+	}
+}
+
+ckdu_index find_child(ckdu_tree const *tree, ckdu_index dir, char const *name) {
+	ckdu_index const first = CKDU_AT(tree->first_child, dir);
+	uint32_t i = 0;
+
+	for (; i < CKDU_AT(tree->child_count, dir); i++) {
+		if (!strcmp(tree_name(tree, first + i), name)) {
+			return first + i;
+		}
+	}
+	return CKDU_NO_INDEX;
+}
+
+ckdu_index path_index_child(ckdu_path_index *index, ckdu_tree const *tree, ckdu_index root,
+		ckdu_index dir, char const *name) {
+	ckdu_index found;
+	size_t i;
+
+	if (!index->capacity) {
+		path_index_fill(index, tree, root);
+	}
+	for (i = hash_child_name(dir, name) & (index->capacity - 1); index->slots[i] != CKDU_NO_INDEX;
+			i = (i + 1) & (index->capacity - 1)) {
+		if (is_child_named(tree, index->slots[i], dir, name)) {
+			return index->slots[i];
+		}
+	}
+
+	/* New since filling, or not there at all */
+	found = find_child(tree, dir, name);
+	if (found != CKDU_NO_INDEX) {
+		if (2 * (index->count + 1) > index->capacity) {
+			path_index_fill(index, tree, root);
+		} else {
+			path_index_insert(index, tree, found);
+		}
+	}
+	return found;
+}
+
+bool skip_root_dirname(char **path, char const *root_dirname) {
+	/* Moves past the starting point, if the path starts there */
+	size_t len = strlen(root_dirname);
+
+	while ((len > 1) && (root_dirname[len - 1] == '/')) {
+		len--;
+	}
+	if (!strcmp(root_dirname, "/")) {
+		len = 0;
+	}
+	if (strncmp(*path, root_dirname, len) || ((*path)[len] && ((*path)[len] != '/'))) {
+		return false;
+	}
+	*path += len;
+	return true;
+}
+
+ckdu_index find_entry(ckdu_server *server, ckdu_tree const *tree, ckdu_index root,
+		char const *root_dirname, char *path) {
+	/* Cuts the path into names in place, ".." included */
+	ckdu_index at = root;
+
+	if ((path[0] == '/') && !(server->real_root && skip_root_dirname(&path, server->real_root))
+			&& !skip_root_dirname(&path, root_dirname)) {
+		return CKDU_NO_INDEX;
+	}
+
+	while (*path) {
+		char * const slash = strchr(path, '/');
+		char * const next = slash ? slash + 1 : path + strlen(path);
+
+		if (slash) {
+			*slash = '\0';
+		}
+		if (!strcmp(path, "..")) {
+			if (at == root) {
+				return CKDU_NO_INDEX;
+			}
+			at = CKDU_AT(tree->parent, at);
+		} else if (*path && strcmp(path, ".")) {
+			at = path_index_child(&server->index, tree, root, at, path);
+			if (at == CKDU_NO_INDEX) {
+				return CKDU_NO_INDEX;
+			}
+		}
+		path = next;
+	}
+	return at;
+}
+
+void output_entry_path(ckdu_output *output, ckdu_tree const *tree, ckdu_index root,
+		char const *root_dirname, ckdu_index index) {
+	/* Names are gathered walking up, then written out in one piece */
+	ckdu_index up = index;
+	size_t len = 0;
+	char *path;
+	char *write;
+
+	for (; up != root; up = CKDU_AT(tree->parent, up)) {
+		len += 1 + strlen(tree_name(tree, up));
+	}
+	path = malloc_or_die(len + 1);
+	write = path + len;
+	for (up = index; up != root; up = CKDU_AT(tree->parent, up)) {
+		char const * const name = tree_name(tree, up);
+		size_t const len_name = strlen(name);
+		write -= len_name;
+		memcpy(write, name, len_name);
+		*--write = '/';
+	}
+
+	output_string(output, root_dirname);
+	output_bytes(output, path, len);
+	free(path);
+}
+
+char * split_word(char **text) {
+	/* Up to the next space, which is skipped */
+	char * const word = *text;
+	char * const space = strchr(word, ' ');
+
+	if (space) {
+		*space = '\0';
+		*text = space + 1;
+	} else {
+		*text = word + strlen(word);
+	}
+	return word;
+}
+
+char const * present_query(ckdu_output *output, ckdu_server *server, ckdu_tree *tree, ckdu_index root,
+		char const *root_dirname, char *query, ckdu_options const *options) {
+	/* Returns what is wrong with the query, or NULL */
+	ckdu_options query_options = *options;
+	char * const format = split_word(&query);
+	char * const command = split_word(&query);
+	ckdu_output dirname;
+	ckdu_index index;
+
+	if (parse_format(format, &query_options.format)) {
+		return "Unknown format";
+	}
+	query_options.color = false;
+	if (!strcmp(command, "size")) {
+		query_options.max_depth = 0;
+	} else if (!strcmp(command, "top") || !strcmp(command, "depth")) {
+		char * const number = split_word(&query);
+		char *end;
+		long const count = strtol(number, &end, 10);
+
+		if (!*number || *end || (count < 0) || (count >= (long)UINT_MAX)) {
+			return "Invalid number";
+		}
+		if (!strcmp(command, "top")) {
+			if (!count) {
+				return "Invalid number";
+			}
+			query_options.max_depth = 1;
+			query_options.max_entries = (unsigned int)count;
+		} else {
+			query_options.max_depth = (unsigned int)count;
+		}
+	} else {
+		return "Unknown query";
+	}
+
+	index = find_entry(server, tree, root, root_dirname, query);
+	if (index == CKDU_NO_INDEX) {
+		return "No such entry";
+	}
+
+	/* CSV rows carry the path up to the entry */
+	output_init_memory(&dirname, false);
+	if (index == root) {
+		output_string(&dirname, root_dirname);
+	} else {
+		output_entry_path(&dirname, tree, root, root_dirname, CKDU_AT(tree->parent, index));
+	}
+	output_bytes(&dirname, "", 1);
+
+	output_string(output, "OK\n");
+	present_formatted(output, tree, index, dirname.buffer, &query_options);
+	free(dirname.buffer);
+	return NULL;
+}
+
+int64_t monotonic_milliseconds(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+int wait_for_client(int fd, short events, int64_t deadline) {
+	/* Returns -1 once the deadline has passed without the client ready */
+	struct pollfd pending;
+	int64_t const left = deadline - monotonic_milliseconds();
+
+	if (left <= 0) {
+		return -1;
+	}
+	pending.fd = fd;
+	pending.events = events;
+	if ((poll(&pending, 1, (int)left) == -1) && (errno != EINTR)) {
+		return -1;
+	}
+	return 0;
+}
+
+void server_answer(ckdu_server *server, ckdu_tree *tree, ckdu_index root,
+		char const *root_dirname, ckdu_options const *options) {
+	/* Takes one connection, reads its query and writes the answer. The
+	 * connection never blocks, nobody gets to keep the tree waiting. */
+	int const fd = accept4(server->listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+	int64_t deadline = monotonic_milliseconds() + CKDU_QUERY_TIMEOUT_SECONDS * 1000;
+	int64_t started;
+	char query[CKDU_QUERY_SIZE];
+	char *end = NULL;
+	size_t len = 0;
+	ckdu_output output;
+	char const *problem;
+
+	if (fd == -1) {
+		return;
+	}
+
+	while (!end && (len < sizeof(query) - 1)) {
+		ssize_t const res = read(fd, query + len, sizeof(query) - 1 - len);
+		if (res == -1) {
+			if ((errno == EINTR) || ((errno == EAGAIN) && !wait_for_client(fd, POLLIN, deadline))) {
+				continue;
+			}
+			close(fd);
+			return;
+		}
+		if (!res) {
+			break;
+		}
+		end = memchr(query + len, '\n', (size_t)res);
+		len += (size_t)res;
+	}
+	if (end) {
+		*end = '\0';
+	} else {
+		query[len] = '\0';
+	}
+
+	started = monotonic_milliseconds();
+	output_init_memory(&output, false);
+	if (!end && (len == sizeof(query) - 1)) {
+		problem = "Query too long";
+	} else {
+		problem = present_query(&output, server, tree, root, root_dirname, query, options);
+	}
+	deadline += monotonic_milliseconds() - started;
+	if (problem) {
+		output_string(&output, "Error: ");
+		output_string(&output, problem);
+		output_string(&output, ".\n");
+	}
+
+	/* Whatever happens to the client, it does not take the server down */
+	len = 0;
+	while (len < output.len) {
+		ssize_t const res = send(fd, output.buffer + len, output.len - len, MSG_NOSIGNAL);
+		if (res == -1) {
+			if ((errno == EINTR) || ((errno == EAGAIN) && !wait_for_client(fd, POLLOUT, deadline))) {
+				continue;
+			}
+			break;
+		}
+		len += (size_t)res;
+	}
+	close(fd);
+	free(output.buffer);
+	free(output.spaces);
+}
+
+int server_open(ckdu_server *server, char const *socket_path) {
+	/* Takes over a socket file left behind, unless somebody answers there.
+	 * Only the same user gets to connect, the tree tells about every file. */
+	struct sockaddr_un address;
+	mode_t mask;
+
+	server->socket_path = socket_path;
+	server->real_root = NULL;
+	server->index.slots = NULL;
+	server->index.capacity = 0;
+	server->index.count = 0;
+	if (strlen(socket_path) >= sizeof(address.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, socket_path);
+
+	server->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (server->listen_fd == -1) {
+		return -1;
+	}
+	mask = umask(077);
+	if (bind(server->listen_fd, (struct sockaddr *)&address, sizeof(address))) {
+		bool failed = (errno != EADDRINUSE);
+
+		if (!failed) {
+			int const probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+			failed = (probe == -1) || !connect(probe, (struct sockaddr *)&address, sizeof(address))
+				|| (errno != ECONNREFUSED);
+			if (probe != -1) {
+				close(probe);
+			}
+			errno = EADDRINUSE;
+		}
+		if (failed || unlink(socket_path)
+				|| bind(server->listen_fd, (struct sockaddr *)&address, sizeof(address))) {
+			int const error = errno;
+			umask(mask);
+			close(server->listen_fd);
+			errno = error;
+			return -1;
+		}
+	}
+	umask(mask);
+	if (listen(server->listen_fd, 16)) {
+		int const error = errno;
+		close(server->listen_fd);
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
+void server_close(ckdu_server *server) {
+	close(server->listen_fd);
+	unlink(server->socket_path);
+	free(server->index.slots);
+	free(server->real_root);
+}
+
+bool take_signal(int signal_fd, ckdu_tree *tree, ckdu_index root, char const *dirname,
+		ckdu_options const *options) {
+	/* Writes out the tree on SIGUSR1, returns false when asked to quit */
+	struct signalfd_siginfo info;
+	ckdu_output output;
+
+	if (read(signal_fd, &info, sizeof(info)) != sizeof(info)) {
+		return true;
+	}
+	if (info.ssi_signo != SIGUSR1) {
+		return false;
+	}
+	output_init(&output, STDOUT_FILENO, options->color);
+	present_formatted(&output, tree, root, dirname, options);
+	output_release(&output);
+	return true;
+}
+
+int run_server(ckdu_server *server, ckdu_tree *tree, ckdu_index root, char const *dirname,
+		sigset_t const *signals, ckdu_options const *options) {
+	/* Returns once asked to quit, for a tree that stays as it is */
+	int const signal_fd = signalfd(-1, signals, SFD_CLOEXEC);
+	struct pollfd fds[2];
+	bool running = true;
+
+	if (signal_fd == -1) {
+		fprintf(stderr, "Error: Cannot take signals (%s).\n", strerror(errno));
+		return 1;
+	}
+
+	while (running) {
+		fds[0].fd = signal_fd;
+		fds[0].events = POLLIN;
+		fds[1].fd = server->listen_fd;
+		fds[1].events = POLLIN;
+		if (poll(fds, 2, -1) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "Error: Waiting for events failed (%s).\n", strerror(errno));
+			exit(1);
+		}
+		if (fds[0].revents & POLLIN) {
+			running = take_signal(signal_fd, tree, root, dirname, options);
+		}
+		if (fds[1].revents & POLLIN) {
+			server_answer(server, tree, root, dirname, options);
+		}
+	}
+
+	close(signal_fd);
+	return 0;
+}
+
+int run_query(char const *socket_path, char * const *words, int word_count, ckdu_options const *options) {
+	/* Asks the ckdu listening there, the answer goes to stdout */
+	struct sockaddr_un address;
+	char buffer[CKDU_QUERY_SIZE];
+	ckdu_output output;
+	bool answered = false;
+	size_t len = 0;
+	int fd;
+	int i = 0;
+
+	if (!word_count) {
+		fprintf(stderr, "Error: --query needs a query, e.g. \"size PATH\".\n");
+		return 1;
+	}
+	for (; i < word_count; i++) {
+		if (strchr(words[i], '\n')) {
+			fprintf(stderr, "Error: Queries go on a single line.\n");
+			return 1;
+		}
+	}
+	if (strlen(socket_path) >= sizeof(address.sun_path)) {
+		fprintf(stderr, "Error: Cannot connect to \"%s\" (%s).\n", socket_path, strerror(ENAMETOOLONG));
+		return 1;
+	}
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, socket_path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if ((fd == -1) || connect(fd, (struct sockaddr *)&address, sizeof(address))) {
+		fprintf(stderr, "Error: Cannot connect to \"%s\" (%s).\n", socket_path, strerror(errno));
+		return 1;
+	}
+
+	output_init(&output, fd, false);
+	output_string(&output, format_names[options->format]);
+	for (i = 0; i < word_count; i++) {
+		output_bytes(&output, " ", 1);
+		output_string(&output, words[i]);
+	}
+	output_bytes(&output, "\n", 1);
+	output_release(&output);
+
+	/* First line tells whether the rest is an answer */
+	output_init(&output, STDOUT_FILENO, false);
+	for (;;) {
+		ssize_t const res = read(fd, buffer + len, sizeof(buffer) - len);
+		char *newline;
+
+		if (res == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "Error: Reading the answer failed (%s).\n", strerror(errno));
+			return 1;
+		}
+		if (!res) {
+			break;
+		}
+		if (answered) {
+			output_bytes(&output, buffer, (size_t)res);
+			continue;
+		}
+
+		len += (size_t)res;
+		newline = memchr(buffer, '\n', len);
+		if (!newline) {
+			if (len == sizeof(buffer)) {
+				break;
+			}
+			continue;
+		}
+		if (((size_t)(newline - buffer) != 2) || memcmp(buffer, "OK", 2)) {
+			fprintf(stderr, "%.*s\n", (int)(newline - buffer), buffer);
+			return 1;
+		}
+		answered = true;
+		output_bytes(&output, newline + 1, len - 3);
+		len = 0;
+	}
+	close(fd);
+	output_release(&output);
+
+	if (!answered) {
+		fprintf(stderr, "Error: No answer from \"%s\".\n", socket_path);
+		return 1;
+	}
+	return 0;
+}
+
+/* With --daemon, the tree is kept up to date after crawling. Every
+ * directory gets an inotify watch. Entries coming or going make their
+ * directory get listed again, entries modified get examined again, and
+ * the difference in size goes up the chain of parents. Children of a
+ * directory listed again move to a new range of indices, leaving the old
+ * one behind. Everything is crawled again when hard links are involved,
+ * when the event queue overflows and when more entries have been left
+ * behind than are in use, once that is a chunk of entries or more.
+ * Directories without a watch, e.g. for lack of watches left, get
+ * listed again every CKDU_DAEMON_RESCAN_SECONDS. */
+#define CKDU_DAEMON_RESCAN_SECONDS 300
+#define CKDU_DAEMON_EVENTS_SIZE 65536
+#define CKDU_DAEMON_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO \
+		| IN_MODIFY | IN_ATTRIB | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+#define CKDU_DAEMON_LISTING_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+
+typedef struct _ckdu_touched_entry {
+	int wd;
+	char const *name;  /* Into the event buffer */
+} ckdu_touched_entry;
+
+typedef struct _ckdu_daemon {
+	ckdu_tree *tree;
+	ckdu_index root;
+	ckdu_inode_set *inode_set;
+	int root_fd;
+	const char *root_dirname;
+	ckdu_options const *options;
+
+	int inotify_fd;
+	ckdu_index *watched;  /* By watch descriptor, CKDU_NO_INDEX for none */
+	size_t watched_capacity;
+	int *watch;  /* By index, -1 for none */
+	size_t watch_capacity;
+	bool missing_watches;
+	bool warned;
+
+	/* Entries left behind by directories listed again */
+	ckdu_index garbage;
+
+	/* For listing directories again */
+	ckdu_name_block names;
+	ckdu_dir_reader reader;
+	ckdu_staging staging;
+	ckdu_index *staged_order;  /* Staged entries by name */
+	ckdu_index *children;  /* Children in the tree by name */
+	ckdu_index *fresh;  /* New directories, still to crawl */
+	size_t order_capacity;
+	size_t children_capacity;
+	size_t fresh_capacity;
+	ckdu_index *stack;
+	size_t stack_capacity;
+
+	/* Collected from one batch of events, by watch descriptor */
+	int *listings;
+	size_t listing_count;
+	size_t listing_capacity;
+	ckdu_touched_entry *touched;
+	size_t touched_count;
+	size_t touched_capacity;
+} ckdu_daemon;
+
+void * grow_or_die(void *items, size_t *capacity, size_t needed, size_t size) {
+	/* Makes room for at least needed items of that size, never
+	 * leaving items NULL, which qsort_r does not take even for none */
+	if (!items || (needed > *capacity)) {
+		size_t const grown = (2 * *capacity > needed) ? 2 * *capacity : (needed ? needed : 1);
+		items = realloc(items, grown * size);
+		if (!items) {
+			handle_out_of_memory();
+		}
+		*capacity = grown;
+	}
+	return items;
+}
+
+void daemon_reserve_watches(ckdu_daemon *daemon) {
+	size_t i = daemon->watch_capacity;
+	daemon->watch = grow_or_die(daemon->watch, &daemon->watch_capacity, daemon->tree->count, sizeof(int));
+	for (; i < daemon->watch_capacity; i++) {
+		daemon->watch[i] = -1;
+	}
+}
+
+ckdu_index * push_index(ckdu_index *stack, size_t *capacity, size_t *count, ckdu_index index) {
+	stack = grow_or_die(stack, capacity, *count + 1, sizeof(ckdu_index));
+	stack[(*count)++] = index;
+	return stack;
+}
+
+void daemon_list_later(ckdu_daemon *daemon, int wd) {
+	size_t i = 0;
+	for (; i < daemon->listing_count; i++) {
+		if (daemon->listings[i] == wd) {
+			return;
+		}
+	}
+	daemon->listings = grow_or_die(daemon->listings, &daemon->listing_capacity,
+			daemon->listing_count + 1, sizeof(int));
+	daemon->listings[daemon->listing_count++] = wd;
+}
+
+bool is_hard_linked(ckdu_daemon const *daemon, ckdu_index index) {
+	/* Whether crawling found more than one link */
+	ckdu_tree const * const tree = daemon->tree;
+	ckdu_inode_slot const *slot;
+
+	if (!daemon->inode_set->capacity || is_nonlink_dir(CKDU_AT(tree->mode, index))) {
+		return false;
+	}
+	slot = inode_set_probe(daemon->inode_set->slots, daemon->inode_set->capacity,
+			tree->devices[CKDU_AT(tree->device, index)], CKDU_AT(tree->inode, index));
+	return (slot->first != CKDU_NO_INDEX) && slot->shared;
+}
+
+ckdu_inode_slot * find_dir_slot(ckdu_daemon const *daemon, ckdu_index dir) {
+	/* The slot a directory of the tree has been claimed with, or NULL */
+	ckdu_tree const * const tree = daemon->tree;
+	ckdu_inode_slot *slot;
+
+	if (!daemon->inode_set->capacity || !is_nonlink_dir(CKDU_AT(tree->mode, dir))) {
+		return NULL;
+	}
+	slot = inode_set_probe(daemon->inode_set->slots, daemon->inode_set->capacity,
+			tree->devices[CKDU_AT(tree->device, dir)], CKDU_AT(tree->inode, dir));
+	return (slot->first == dir) ? slot : NULL;
+}
+
+void daemon_watch(ckdu_daemon *daemon, ckdu_index dir) {
+	/* Directories that changed between crawling and
+	 * getting watched are listed again, too */
+	ckdu_tree * const tree = daemon->tree;
+	char * const path = malloc_tree_path(daemon->root_dirname, tree, dir);
+	ckdu_staged_entry entry;
+	int wd;
+	size_t i = daemon->watched_capacity;
+
+	if (!path) {
+		handle_out_of_memory();
+	}
+	wd = inotify_add_watch(daemon->inotify_fd, path, CKDU_DAEMON_WATCH_MASK);
+	if (wd == -1) {
+		if (!daemon->warned) {
+			fprintf(stderr, "Warning: Cannot watch \"%s\" (%s), listing directories "
+					"without a watch again every %i seconds.\n",
+					path, strerror(errno), CKDU_DAEMON_RESCAN_SECONDS);
+			daemon->warned = true;
+		}
+		daemon->missing_watches = true;
+		free(path);
+		return;
+	}
+
+	daemon->watched = grow_or_die(daemon->watched, &daemon->watched_capacity,
+			(size_t)wd + 1, sizeof(ckdu_index));
+	for (; i < daemon->watched_capacity; i++) {
+		daemon->watched[i] = CKDU_NO_INDEX;
+	}
+	if ((daemon->watched[wd] != CKDU_NO_INDEX) && (daemon->watched[wd] != dir)) {
+		/* Same directory at a new place, the old one is about to go */
+		daemon->watch[daemon->watched[wd]] = -1;
+	}
+	daemon->watched[wd] = dir;
+	daemon->watch[dir] = wd;
+
+	if (!fetch_metadata(&entry, AT_FDCWD, path, daemon->options)
+			&& ((entry.mtime != CKDU_AT(tree->mtime, dir)) || (entry.ctime != CKDU_AT(tree->ctime, dir)))) {
+		daemon_list_later(daemon, wd);
+	}
+	free(path);
+}
+
+void daemon_watch_subtree(ckdu_daemon *daemon, ckdu_index dir) {
+	ckdu_tree const * const tree = daemon->tree;
+	size_t count = 0;
+
+	daemon_reserve_watches(daemon);
+	daemon->stack = push_index(daemon->stack, &daemon->stack_capacity, &count, dir);
+	while (count) {
+		ckdu_index const index = daemon->stack[--count];
+		ckdu_index const first = CKDU_AT(tree->first_child, index);
+		uint32_t i = 0;
+
+		daemon_watch(daemon, index);
+		for (; i < CKDU_AT(tree->child_count, index); i++) {
+			if (is_nonlink_dir(CKDU_AT(tree->mode, first + i))) {
+				daemon->stack = push_index(daemon->stack, &daemon->stack_capacity, &count, first + i);
+			}
+		}
+	}
+}
+
+bool daemon_forget(ckdu_daemon *daemon, ckdu_index index) {
+	/* Drops the watches of an entry gone and of everything below.
+	 * Returns whether any of it has been counted as a hard link. */
+	ckdu_tree const * const tree = daemon->tree;
+	bool hard_linked = false;
+	size_t count = 0;
+
+	daemon->stack = push_index(daemon->stack, &daemon->stack_capacity, &count, index);
+	while (count) {
+		ckdu_index const gone = daemon->stack[--count];
+		ckdu_index const first = CKDU_AT(tree->first_child, gone);
+		int const wd = daemon->watch[gone];
+		ckdu_inode_slot * const slot = find_dir_slot(daemon, gone);
+		uint32_t i = 0;
+
+		hard_linked = hard_linked || is_hard_linked(daemon, gone);
+		if (slot) {
+			/* Free to turn up again elsewhere */
+			inode_set_remove(daemon->inode_set, slot);
+		}
+		if (wd != -1) {
+			if (daemon->watched[wd] == gone) {
+				inotify_rm_watch(daemon->inotify_fd, wd);
+				daemon->watched[wd] = CKDU_NO_INDEX;
+			}
+			daemon->watch[gone] = -1;
+		}
+		if (!is_nonlink_dir(CKDU_AT(tree->mode, gone))) {
+			continue;
+		}
+		daemon->garbage += CKDU_AT(tree->child_count, gone);
+		for (; i < CKDU_AT(tree->child_count, gone); i++) {
+			daemon->stack = push_index(daemon->stack, &daemon->stack_capacity, &count, first + i);
+		}
+	}
+	return hard_linked;
+}
+
+void daemon_move_entry(ckdu_daemon *daemon, ckdu_index from, ckdu_index to) {
+	/* The parent stays the same, children learn about the move */
+	ckdu_tree * const tree = daemon->tree;
+	ckdu_index const first = CKDU_AT(tree->first_child, from);
+	uint32_t const count = CKDU_AT(tree->child_count, from);
+	int const wd = daemon->watch[from];
+	ckdu_inode_slot * const slot = find_dir_slot(daemon, from);
+	uint32_t i = 0;
+
+	if (slot) {
+		slot->first = to;
+	}
+	CKDU_AT(tree->name_offset, to) = CKDU_AT(tree->name_offset, from);
+	CKDU_AT(tree->content_size, to) = CKDU_AT(tree->content_size, from);
+	CKDU_AT(tree->total_size, to) = CKDU_AT(tree->total_size, from);
+	CKDU_AT(tree->inode, to) = CKDU_AT(tree->inode, from);
+	CKDU_AT(tree->mode, to) = CKDU_AT(tree->mode, from);
+	CKDU_AT(tree->device, to) = CKDU_AT(tree->device, from);
+	CKDU_AT(tree->parent, to) = CKDU_AT(tree->parent, from);
+	CKDU_AT(tree->first_child, to) = first;
+	CKDU_AT(tree->child_count, to) = count;
+	CKDU_AT(tree->mtime, to) = CKDU_AT(tree->mtime, from);
+	CKDU_AT(tree->ctime, to) = CKDU_AT(tree->ctime, from);
+	adopt_file_columns(tree, to, tree, from);
+
+	for (; i < count; i++) {
+		CKDU_AT(tree->parent, first + i) = to;
+	}
+	daemon->watch[to] = wd;
+	daemon->watch[from] = -1;
+	if (wd != -1) {
+		daemon->watched[wd] = to;
+	}
+}
+
+int compare_staged_names(const void *void_a, const void *void_b, void *void_staging) {
+	ckdu_staging const * const staging = (ckdu_staging const *)void_staging;
+	return strcmp(staging->names + staging->entries[*(ckdu_index const *)void_a].name_pos,
+			staging->names + staging->entries[*(ckdu_index const *)void_b].name_pos);
+}
+
+int open_tree_directory(ckdu_tree const *tree, ckdu_index index) {
+	int fd;
+	if (CKDU_AT(tree->parent, index) == CKDU_NO_INDEX) {
+		/* Not a duplicate, that would share the position in the listing */
+		return open_directory_at(tree->root_fd, ".");
+	}
+	fd = open_parent_directory(tree, index);
+	if (fd != -1) {
+		int const parent_fd = fd;
+		fd = open_directory_at(parent_fd, tree_name(tree, index));
+		close(parent_fd);
+	}
+	return fd;
+}
+
+bool is_still_there(ckdu_daemon const *daemon, ckdu_index index) {
+	/* Whether an entry is where the tree has it, rather than moved away
+	 * or dropped already by listing a directory above again */
+	ckdu_tree const * const tree = daemon->tree;
+	ckdu_staged_entry entry;
+	ckdu_index up = index;
+	int fd;
+	int res;
+
+	for (; CKDU_AT(tree->parent, up) != CKDU_NO_INDEX; up = CKDU_AT(tree->parent, up)) {
+		ckdu_index const parent = CKDU_AT(tree->parent, up);
+		ckdu_index const first = CKDU_AT(tree->first_child, parent);
+		if ((first == CKDU_NO_INDEX) || (up < first) || (up - first >= CKDU_AT(tree->child_count, parent))) {
+			return false;
+		}
+	}
+	if (index == up) {
+		return true;
+	}
+
+	fd = open_parent_directory(tree, index);
+	if (fd == -1) {
+		return false;
+	}
+	res = fetch_metadata(&entry, fd, tree_name(tree, index), daemon->options);
+	close(fd);
+	return !res && (entry.inode == CKDU_AT(tree->inode, index))
+		&& (entry.device == tree->devices[CKDU_AT(tree->device, index)]);
+}
+
+bool crawl_fresh_directory(ckdu_daemon *daemon, ckdu_index dir, int parent_fd) {
+	/* Like the initial crawl, below a directory new to the tree. Returns
+	 * whether any hard links or directories known already turned up. */
+	ckdu_tree * const tree = daemon->tree;
+	ckdu_index const parent = CKDU_AT(tree->parent, dir);
+	char * const path = malloc_tree_path(daemon->root_dirname, tree, dir);
+	int const fd = open_directory_at(parent_fd, tree_name(tree, dir));
+	ckdu_inode_set inode_set;
+	bool hard_linked = false;
+	size_t i = 0;
+
+	if (!path) {
+		handle_out_of_memory();
+	}
+	if (fd == -1) {
+		handle_opendir_error(errno, path);
+		free(path);
+		return false;
+	}
+
+	/* Shared inodes are added up no further than the new directory,
+	 * directories found get claimed in the set of the daemon after.
+	 * Claimed there before, they are either the same as one elsewhere
+	 * in the tree, or have been moved here from a directory that has
+	 * not been listed again yet, which then no longer has them. */
+	inode_set_init(&inode_set);
+	CKDU_AT(tree->parent, dir) = CKDU_NO_INDEX;
+	crawl_tree(tree, dir, NULL, CKDU_NO_INDEX, &inode_set, NULL, fd, path, daemon->options);
+	CKDU_AT(tree->parent, dir) = parent;
+	for (; i < inode_set.capacity; i++) {
+		ckdu_inode_slot const * const slot = inode_set.slots + i;
+		ckdu_inode_slot *claimed;
+		bool inserted;
+
+		if (slot->first == CKDU_NO_INDEX) {
+			continue;
+		}
+		if (slot->shared) {
+			hard_linked = true;
+			continue;
+		}
+		claimed = inode_set_insert(daemon->inode_set, slot->device, slot->inode, slot->first, &inserted);
+		if (inserted) {
+			continue;
+		} else if (is_still_there(daemon, claimed->first)) {
+			hard_linked = true;
+		} else {
+			claimed->first = slot->first;
+		}
+	}
+	inode_set_release(&inode_set);
+
+	close(fd);
+	free(path);
+	daemon_watch_subtree(daemon, dir);
+	return hard_linked;
+}
+
+int daemon_list_again(ckdu_daemon *daemon, ckdu_index dir) {
+	/* Matches entries by name with the children in the tree. Returns
+	 * -1 if only crawling everything again keeps the totals exact. */
+	ckdu_tree * const tree = daemon->tree;
+	ckdu_staging * const staging = &daemon->staging;
+	ckdu_options const * const options = daemon->options;
+	ckdu_index const old_first = CKDU_AT(tree->first_child, dir);
+	uint32_t const old_count = CKDU_AT(tree->child_count, dir);
+	ckdu_index first = CKDU_NO_INDEX;
+	size_t fresh_count = 0;
+	bool hard_linked = false;
+	ckdu_staged_entry self;
+	struct dirent64 *entry;
+	off_t delta;
+	ckdu_index up;
+	size_t s = 0;
+	size_t o = 0;
+	int const fd = open_tree_directory(tree, dir);
+
+	if (fd == -1) {
+		/* Gone, its parent hears about that */
+		return 0;
+	}
+	if (fetch_metadata(&self, fd, ".", options) || (self.inode != CKDU_AT(tree->inode, dir))) {
+		close(fd);
+		return 0;
+	}
+
+	staging->count = 0;
+	staging->names_len = 0;
+	daemon->reader.pos = 0;
+	daemon->reader.len = 0;
+	do {
+		errno = 0;
+		entry = dir_reader_next(&daemon->reader, fd);
+		if (entry) {
+			ckdu_staged_entry * const staged = stage_entry(staging, entry->d_name);
+			if (fetch_metadata(staged, fd, entry->d_name, options)) {
+				/* Gone again already */
+				unstage_entry(staging);
+			}
+		}
+	} while (entry);
+	if (errno) {
+		close(fd);
+		return -1;
+	}
+
+	daemon->staged_order = grow_or_die(daemon->staged_order, &daemon->order_capacity,
+			staging->count, sizeof(ckdu_index));
+	daemon->fresh = grow_or_die(daemon->fresh, &daemon->fresh_capacity,
+			staging->count, sizeof(ckdu_index));
+	for (s = 0; s < staging->count; s++) {
+		daemon->staged_order[s] = (ckdu_index)s;
+	}
+	qsort_r(daemon->staged_order, staging->count, sizeof(ckdu_index), compare_staged_names, staging);
+	daemon->children = grow_or_die(daemon->children, &daemon->children_capacity,
+			old_count, sizeof(ckdu_index));
+	for (o = 0; o < old_count; o++) {
+		daemon->children[o] = old_first + o;
+	}
+	qsort_r(daemon->children, old_count, sizeof(ckdu_index), compare_indices_by_name, tree);
+
+	delta = self.content_size - CKDU_AT(tree->content_size, dir);
+	CKDU_AT(tree->content_size, dir) = self.content_size;
+	CKDU_AT(tree->mode, dir) = self.mode;
+	CKDU_AT(tree->mtime, dir) = self.mtime;
+	CKDU_AT(tree->ctime, dir) = self.ctime;
+
+	if (staging->count) {
+		first = tree_reserve(tree, (uint32_t)staging->count);
+		daemon_reserve_watches(daemon);
+	}
+	for (s = 0, o = 0; (s < staging->count) || (o < old_count); ) {
+		ckdu_staged_entry const * const staged = (s < staging->count)
+				? staging->entries + daemon->staged_order[s] : NULL;
+		ckdu_index const old = (o < old_count) ? daemon->children[o] : CKDU_NO_INDEX;
+		int const order = !staged ? 1
+				: ((old == CKDU_NO_INDEX) ? -1 : strcmp(staging->names + staged->name_pos, tree_name(tree, old)));
+		ckdu_index const to = first + (ckdu_index)s;
+
+		if ((order > 0) || ((order == 0) && ((staged->inode != CKDU_AT(tree->inode, old))
+				|| ((staged->mode ^ CKDU_AT(tree->mode, old)) & S_IFMT)))) {
+			/* Gone, or replaced by something else */
+			delta -= CKDU_AT(tree->total_size, old);
+			hard_linked = daemon_forget(daemon, old) || hard_linked;
+			o++;
+			if (order > 0) {
+				continue;
+			}
+		} else if (order == 0) {
+			/* Still there */
+			off_t const change = staged->content_size - CKDU_AT(tree->content_size, old);
+			if (!is_nonlink_dir(staged->mode)
+					&& ((is_hard_linked(daemon, old) != (staged->link_count > 1))
+						|| (change && (staged->link_count > 1)))) {
+				hard_linked = true;
+			}
+			daemon_move_entry(daemon, old, to);
+			CKDU_AT(tree->content_size, to) += change;
+			CKDU_AT(tree->total_size, to) += change;
+			CKDU_AT(tree->mode, to) = staged->mode;
+			CKDU_AT(tree->mtime, to) = staged->mtime;
+			CKDU_AT(tree->ctime, to) = staged->ctime;
+			delta += change;
+			o++;
+			s++;
+			continue;
+		}
+
+		/* New */
+		tree_set_entry(tree, to, staged,
+				tree_add_name(tree, &daemon->names, staging->names + staged->name_pos, staged->name_len),
+				tree_device_index(tree, staged->device), dir);
+		if (is_nonlink_dir(staged->mode)) {
+			daemon->fresh[fresh_count++] = to;
+		} else {
+			hard_linked = hard_linked || (staged->link_count > 1);
+			delta += staged->content_size;
+		}
+		s++;
+	}
+
+	daemon->garbage += old_count;
+	CKDU_AT(tree->first_child, dir) = first;
+	CKDU_AT(tree->child_count, dir) = (uint32_t)staging->count;
+
+	for (s = 0; s < fresh_count; s++) {
+		ckdu_index const fresh = daemon->fresh[s];
+		hard_linked = crawl_fresh_directory(daemon, fresh, fd) || hard_linked;
+		delta += CKDU_AT(tree->total_size, fresh);
+	}
+	close(fd);
+
+	for (up = dir; up != CKDU_NO_INDEX; up = CKDU_AT(tree->parent, up)) {
+		CKDU_AT(tree->total_size, up) += delta;
+	}
+	return hard_linked ? -1 : 0;
+}
+
+int daemon_examine_again(ckdu_daemon *daemon, ckdu_index index) {
+	/* For entries modified in place. Returns -1 like daemon_list_again. */
+	ckdu_tree * const tree = daemon->tree;
+	int const dir_fd = open_parent_directory(tree, index);
+	ckdu_staged_entry entry;
+	off_t change;
+	ckdu_index up;
+	int res;
+
+	if (dir_fd == -1) {
+		/* Gone with a directory above, which hears about that */
+		return 0;
+	}
+	res = fetch_metadata(&entry, dir_fd, tree_name(tree, index), daemon->options);
+	close(dir_fd);
+	if (res) {
+		/* Gone, its directory hears about that */
+		return 0;
+	}
+	if ((entry.inode != CKDU_AT(tree->inode, index))
+			|| ((entry.mode ^ CKDU_AT(tree->mode, index)) & S_IFMT)) {
+		return daemon_list_again(daemon, CKDU_AT(tree->parent, index));
+	}
+
+	change = entry.content_size - CKDU_AT(tree->content_size, index);
+	if (!is_nonlink_dir(entry.mode)
+			&& ((is_hard_linked(daemon, index) != (entry.link_count > 1))
+				|| (change && (entry.link_count > 1)))) {
+		return -1;
+	}
+	CKDU_AT(tree->content_size, index) = entry.content_size;
+	CKDU_AT(tree->mode, index) = entry.mode;
+	CKDU_AT(tree->mtime, index) = entry.mtime;
+	CKDU_AT(tree->ctime, index) = entry.ctime;
+	for (up = index; up != CKDU_NO_INDEX; up = CKDU_AT(tree->parent, up)) {
+		CKDU_AT(tree->total_size, up) += change;
+	}
+	return 0;
+}
+
+void daemon_crawl_again(ckdu_daemon *daemon) {
+	/* Starts over, with a tree of its own and a fresh set of watches */
+	ckdu_tree * const tree = daemon->tree;
+	bool const file_aggregates = tree->file_aggregates;
+	bool const other_buckets = tree->other_buckets;
+	ckdu_staged_entry entry;
+	size_t i = 0;
+
+	close(daemon->inotify_fd);
+	daemon->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (daemon->inotify_fd == -1) {
+		fprintf(stderr, "Error: Cannot watch directories (%s).\n", strerror(errno));
+		exit(1);
+	}
+	for (; i < daemon->watched_capacity; i++) {
+		daemon->watched[i] = CKDU_NO_INDEX;
+	}
+	for (i = 0; i < daemon->watch_capacity; i++) {
+		daemon->watch[i] = -1;
+	}
+	daemon->missing_watches = false;
+	daemon->garbage = 0;
+	daemon->listing_count = 0;
+	daemon->touched_count = 0;
+	daemon->names.next = 0;
+	daemon->names.end = 0;
+
+	errno = 0;
+	if (fetch_metadata(&entry, daemon->root_fd, ".", daemon->options)) {
+		handle_stat_error(errno, daemon->root_dirname, ".");
+		exit(1);
+	}
+	inode_set_release(daemon->inode_set);
+	tree_release(tree);
+	tree_init(tree, file_aggregates, other_buckets);
+	tree->root_fd = daemon->root_fd;
+	daemon->root = plant_root(tree, &entry);
+
+	/* Crawling reads a duplicate, which has been read to the end before */
+	lseek(daemon->root_fd, 0, SEEK_SET);
+	crawl_tree(tree, daemon->root, NULL, CKDU_NO_INDEX, daemon->inode_set, NULL,
+			daemon->root_fd, daemon->root_dirname, daemon->options);
+	daemon_watch_subtree(daemon, daemon->root);
+}
+
+int daemon_list_unwatched(ckdu_daemon *daemon) {
+	/* Top down, so that directories listed again only ever move
+	 * children that have not been visited yet. Has a stack of its
+	 * own, listing again takes the one of the daemon. */
+	ckdu_tree const * const tree = daemon->tree;
+	ckdu_index *stack = NULL;
+	size_t capacity = 0;
+	size_t count = 0;
+
+	daemon->missing_watches = false;
+	stack = push_index(stack, &capacity, &count, daemon->root);
+	while (count) {
+		ckdu_index const dir = stack[--count];
+		ckdu_index first;
+		uint32_t i = 0;
+
+		if (daemon->watch[dir] == -1) {
+			daemon_watch(daemon, dir);
+			if (daemon_list_again(daemon, dir)) {
+				free(stack);
+				return -1;
+			}
+		}
+		first = CKDU_AT(tree->first_child, dir);
+		for (; i < CKDU_AT(tree->child_count, dir); i++) {
+			if (is_nonlink_dir(CKDU_AT(tree->mode, first + i))) {
+				stack = push_index(stack, &capacity, &count, first + i);
+			}
+		}
+	}
+	free(stack);
+	return 0;
+}
+
+int daemon_handle_events(ckdu_daemon *daemon, char *buffer, size_t len) {
+	/* Collects what needs a look first, to look only once per batch,
+	 * on top of directories that changed before getting watched.
+	 * Returns -1 like daemon_list_again. */
+	size_t pos = 0;
+	size_t i = 0;
+	int res = 0;
+
+	while (pos < len) {
+		struct inotify_event const * const event = (struct inotify_event const *)(buffer + pos);
+		pos += sizeof(struct inotify_event) + event->len;
+
+		if (event->mask & IN_Q_OVERFLOW) {
+			res = -1;
+			break;
+		}
+		if ((event->wd < 0) || ((size_t)event->wd >= daemon->watched_capacity)
+				|| (daemon->watched[event->wd] == CKDU_NO_INDEX)) {
+			continue;
+		}
+		if (event->mask & IN_IGNORED) {
+			daemon->watch[daemon->watched[event->wd]] = -1;
+			daemon->watched[event->wd] = CKDU_NO_INDEX;
+		} else if (!event->len) {
+			/* About the directory itself, its parent hears about that */
+		} else if (event->mask & CKDU_DAEMON_LISTING_MASK) {
+			daemon_list_later(daemon, event->wd);
+		} else if (!daemon->touched_count
+				|| (daemon->touched[daemon->touched_count - 1].wd != event->wd)
+				|| strcmp(daemon->touched[daemon->touched_count - 1].name, event->name)) {
+			daemon->touched = grow_or_die(daemon->touched, &daemon->touched_capacity,
+					daemon->touched_count + 1, sizeof(ckdu_touched_entry));
+			daemon->touched[daemon->touched_count].wd = event->wd;
+			daemon->touched[daemon->touched_count].name = event->name;
+			daemon->touched_count++;
+		}
+	}
+
+	/* More may come up while listing, from directories new to the tree */
+	for (i = 0; !res && (i < daemon->listing_count); i++) {
+		ckdu_index const dir = daemon->watched[daemon->listings[i]];
+		if (dir != CKDU_NO_INDEX) {
+			res = daemon_list_again(daemon, dir);
+		}
+	}
+	for (i = 0; !res && (i < daemon->touched_count); i++) {
+		ckdu_touched_entry const * const touched = daemon->touched + i;
+		ckdu_index const dir = daemon->watched[touched->wd];
+		ckdu_index index;
+		size_t k = 0;
+
+		for (; (k < daemon->listing_count) && (daemon->listings[k] != touched->wd); k++) {
+		}
+		if ((dir == CKDU_NO_INDEX) || (k < daemon->listing_count)) {
+			continue;
+		}
+		index = find_child(daemon->tree, dir, touched->name);
+		if (index != CKDU_NO_INDEX) {
+			res = daemon_examine_again(daemon, index);
+		}
+	}
+
+	daemon->listing_count = 0;
+	daemon->touched_count = 0;
+	return res;
+}
+
+void daemon_settle(ckdu_daemon *daemon, char *buffer, size_t len) {
+	/* Crawls everything again for as long as it takes */
+	while (daemon_handle_events(daemon, buffer, len)) {
+		daemon_crawl_again(daemon);
+		len = 0;
+	}
+}
+
+int run_daemon(ckdu_tree *tree, ckdu_index *root, ckdu_inode_set *inode_set, int dir_fd,
+		char const *dirname, ckdu_server *server, sigset_t const *signals, ckdu_options const *options) {
+	/* Returns once asked to quit, or non-zero if watching is impossible.
+	 * Answers queries in between with a server, NULL for none. */
+	ckdu_daemon daemon;
+	struct pollfd fds[3];
+	char *buffer = malloc(CKDU_DAEMON_EVENTS_SIZE);
+	time_t next_rescan = time(NULL) + CKDU_DAEMON_RESCAN_SECONDS;
+	bool running = true;
+	int const signal_fd = signalfd(-1, signals, SFD_CLOEXEC);
+
+	memset(&daemon, 0, sizeof(daemon));
+	daemon.tree = tree;
+	daemon.root = *root;
+	daemon.inode_set = inode_set;
+	daemon.root_fd = dir_fd;
+	daemon.root_dirname = dirname;
+	daemon.options = options;
+	daemon.reader.buffer = malloc(CKDU_DIR_BUFFER_SIZE);
+	daemon.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (!buffer || !daemon.reader.buffer) {
+		handle_out_of_memory();
+	}
+	if ((signal_fd == -1) || (daemon.inotify_fd == -1)) {
+		fprintf(stderr, "Error: Cannot watch directories (%s).\n", strerror(errno));
+		free(buffer);
+		free(daemon.reader.buffer);
+		return 1;
+	}
+	daemon_watch_subtree(&daemon, daemon.root);
+	daemon_settle(&daemon, buffer, 0);
+
+	while (running) {
+		time_t const now = time(NULL);
+		int const timeout = !daemon.missing_watches ? -1
+				: ((next_rescan > now) ? (int)(next_rescan - now) * 1000 : 0);
+		int ready;
+
+		fds[0].fd = signal_fd;
+		fds[0].events = POLLIN;
+		fds[1].fd = daemon.inotify_fd;
+		fds[1].events = POLLIN;
+		fds[2].fd = server ? server->listen_fd : -1;
+		fds[2].events = POLLIN;
+		fds[2].revents = 0;
+		ready = poll(fds, server ? 3 : 2, timeout);
+		if (ready == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "Error: Waiting for events failed (%s).\n", strerror(errno));
+			exit(1);
+		}
+
+		if (fds[0].revents & POLLIN) {
+			running = take_signal(signal_fd, tree, daemon.root, dirname, options);
+		}
+
+		if (fds[1].revents & POLLIN) {
+			ssize_t const len = read(daemon.inotify_fd, buffer, CKDU_DAEMON_EVENTS_SIZE);
+			if (len > 0) {
+				daemon_settle(&daemon, buffer, (size_t)len);
+			}
+		}
+
+		if (daemon.missing_watches && (time(NULL) >= next_rescan)) {
+			next_rescan = time(NULL) + CKDU_DAEMON_RESCAN_SECONDS;
+			if (daemon_list_unwatched(&daemon)) {
+				daemon_crawl_again(&daemon);
+			}
+			daemon_settle(&daemon, buffer, 0);
+		}
+
+		if ((daemon.garbage > tree->count / 2) && (daemon.garbage >= CKDU_TREE_CHUNK_SIZE)) {
+			/* Compacts the tree, too */
+			daemon_crawl_again(&daemon);
+			daemon_settle(&daemon, buffer, 0);
+		}
+
+		if (fds[2].revents & POLLIN) {
+			server_answer(server, tree, daemon.root, dirname, options);
+		}
+	}
+
+	*root = daemon.root;
+	close(signal_fd);
+	close(daemon.inotify_fd);
+	free(buffer);
+	free(daemon.reader.buffer);
+	free(daemon.staging.entries);
+	free(daemon.staging.names);
+	free(daemon.staging.files);
+	free(daemon.staged_order);
+	free(daemon.children);
+	free(daemon.fresh);
+	free(daemon.stack);
+	free(daemon.watched);
+	free(daemon.watch);
+	free(daemon.listings);
+	free(daemon.touched);
+	return 0;
+}
+
+void print_tree_stats(ckdu_tree const *tree) {
+	size_t const bytes_per_entry = sizeof(uint64_t) + 2 * sizeof(off_t) + sizeof(uint64_t)
+			+ 2 * sizeof(uint32_t) + 2 * sizeof(ckdu_index) + sizeof(uint32_t) + 2 * sizeof(int64_t)
+			+ (tree->file_aggregates ? sizeof(uint32_t) + 2 * sizeof(off_t) : 0)
+			+ (tree->other_buckets ? sizeof(uint32_t) + sizeof(off_t) : 0);
+	uint64_t names_used = 0;
+	ckdu_index i = 0;
+
+	/* Names take what is left of their blocks, so count them one by one */
+	for (; i < tree->count; i++) {
+		names_used += strlen(tree_name(tree, i)) + 1;
+		if (tree->link_offset && is_symlink(CKDU_AT(tree->mode, i))) {
+			names_used += strlen(tree_name_at(tree, CKDU_AT(tree->link_offset, i))) + 1;
+		}
+	}
+
+	if (tree->mapping) {
+		/* Nothing reserved, columns and names point into the snapshot */
+		fprintf(stderr, "Tree: %lu entries, %lu bytes used, mapped from a snapshot of %lu bytes\n",
+				(unsigned long)tree->count,
+				(unsigned long)(tree->count * bytes_per_entry),
+				(unsigned long)tree->mapping_len);
+		fprintf(stderr, "Names: %lu bytes used, mapped from the same snapshot\n",
+				(unsigned long)names_used);
+		return;
+	}
+
+	fprintf(stderr, "Tree: %lu entries, %lu bytes used of %lu bytes reserved in %lu chunks of columns\n",
+			(unsigned long)tree->count,
+			(unsigned long)(tree->count * bytes_per_entry),
+			(unsigned long)(tree->chunk_count * CKDU_TREE_CHUNK_SIZE * bytes_per_entry),
+			tree->chunk_count);
+	fprintf(stderr, "Names: %lu bytes used of %lu bytes reserved in %lu chunks\n",
+			(unsigned long)names_used,
+			(unsigned long)(tree->names_chunk_count * CKDU_NAMES_CHUNK_SIZE),
+			tree->names_chunk_count);
+}
+
+void print_inode_set_stats(ckdu_inode_set const *set) {
+	fprintf(stderr, "Inode set: %lu inodes in %lu slots (%lu bytes)\n",
+			(unsigned long)set->count, (unsigned long)set->capacity,
+			(unsigned long)(set->capacity * sizeof(ckdu_inode_slot)));
+}
+
+/* Values of options without a short form */
+enum ckdu_long_option {
+	OPTION_ENGINE = 256,
+	OPTION_QUEUE_DEPTH,
+	OPTION_INODE_ORDER,
+	OPTION_ALLOCATED,
+	OPTION_DONT_SYNC,
+	OPTION_BORING,
+	OPTION_BORING_NAMES,
+	OPTION_DIRS_ONLY,
+	OPTION_MAX_ENTRIES,
+	OPTION_THRESHOLD,
+	OPTION_THRESHOLD_PERCENT,
+	OPTION_TOP,
+	OPTION_COLOR,
+	OPTION_FORMAT,
+	OPTION_STREAM,
+	OPTION_SAVE,
+	OPTION_LOAD,
+	OPTION_SINCE,
+	OPTION_DIFF,
+	OPTION_DAEMON,
+	OPTION_LISTEN,
+	OPTION_QUERY,
+	OPTION_STATS
+};
+
+char const * const default_boring_names[] = {"autom4te.cache", ".git", ".svn", "CVS"};
+
+size_t split_names(char *list, char const **names) {
+	/* Splits a comma-separated list in place, names may be NULL for counting */
+	size_t count = 0;
+	char *start = list;
+
+	for (;;) {
+		char * const comma = strchr(start, ',');
+		if (comma && names) {
+			*comma = '\0';
+		}
+		if (*start && (start != comma)) {
+			if (names) {
+				names[count] = start;
+			}
+			count++;
+		}
+		if (!comma) {
+			return count;
+		}
+		start = comma + 1;
+	}
+}
+
+int parse_size(char const *text, off_t *bytes) {
+	/* Binary suffixes, like on output */
+	char const suffixes[] = "kMGT";
+	char *end;
+	unsigned long value;
+	int shift = 0;
+
+	if ((*text < '0') || (*text > '9')) {
+		return -1;
+	}
+	errno = 0;
+	value = strtoul(text, &end, 10);
+	if (errno) {
+		return -1;
+	}
+	if (*end) {
+		char const * const suffix = strchr(suffixes, *end);
+		if (!suffix || end[1]) {
+			return -1;
+		}
+		shift = 10 * (int)(suffix - suffixes + 1);
+	}
+	if (value > ((ULONG_MAX >> 1) >> shift)) {
+		return -1;
+	}
+
+	*bytes = (off_t)(value << shift);
+	return 0;
+}
+
+void print_usage(FILE *file, const char *argv0) {
+	char const * const lines[] = {
+		"",
+		"  -j, --jobs=N          crawl using N threads (default: 1)",
+		"  -d, --max-depth=N     list entries no more than N levels deep, deeper",
+		"                        ones are counted without being kept in memory",
+		"  -s, --summarize       list the total only, same as --max-depth=0",
+		"      --dirs-only       list directories only, with a summary of the files",
+		"                        right inside each",
+		"      --max-entries=N   list no more than the N biggest entries per",
+		"                        directory and sum up the rest in one line",
+		"      --threshold=SIZE  sum up entries smaller than SIZE bytes, with an",
+		"                        optional suffix k, M, G or T, with the rest",
+		"      --threshold-percent=P",
+		"                        sum up entries smaller than P percent of their",
+		"                        directory with the rest",
+		"      --top=N           list the N biggest files and directories anywhere,",
+		"                        with their paths, instead of the tree",
+		"      --engine=E        issue metadata requests through \"sync\" system",
+		"                        calls (default) or batched through \"uring\"",
+		"      --queue-depth=N   requests in flight per thread with --engine=uring",
+		"                        (default: 64)",
+		"      --inode-order     examine entries in inode number order, which saves",
+		"                        seeks on rotational disks with a cold cache",
+		"      --allocated       report disk blocks allocated rather than apparent size",
+		"      --dont-sync       accept cached, possibly stale metadata from network",
+		"                        file systems",
+		"      --boring=MODE     crawl boring folders \"full\"y (default), add up",
+		"                        only their immediate entries (\"shallow\") or",
+		"                        \"skip\" their content altogether",
+		"      --boring-names=LIST",
+		"                        comma-separated names of boring folders",
+		"                        (default: autom4te.cache,.git,.svn,CVS)",
+		"      --format=F        write a \"tree\" for humans (default), \"json\",",
+		"                        \"csv\" or \"bin\"ary records, with exact numbers",
+		"      --stream          write a line of JSON per entry as soon as it has",
+		"                        been examined and per directory once added up,",
+		"                        unsorted, without keeping a tree",
+		"      --save=FILE       keep a snapshot of the tree in FILE",
+		"      --load=FILE       present a snapshot from FILE instead of crawling",
+		"      --since=FILE      take directories from the snapshot in FILE rather",
+		"                        than crawling them where inode number,",
+		"                        modification and change time still match, for",
+		"                        them and their parent directory alike, which",
+		"                        misses files changed in place inside them",
+		"      --diff=FILE       list what changed per directory from the earlier",
+		"                        snapshot in FILE to the one from --load, biggest",
+		"                        changes first",
+		"      --daemon          keep the tree up to date after crawling, watching",
+		"                        for changes, and write it out whenever sent SIGUSR1,",
+		"                        until sent SIGINT or SIGTERM",
+		"      --listen=SOCKET   answer queries about the tree on a Unix domain",
+		"                        socket after crawling, until sent SIGINT or SIGTERM,",
+		"                        for nobody but the same user",
+		"      --query=SOCKET    ask the ckdu listening on SOCKET instead of",
+		"                        crawling, with the arguments \"size [PATH]\",",
+		"                        \"top N [PATH]\" or \"depth N [PATH]\"",
+		"      --color=WHEN      mark file types with colors \"always\", \"never\" or",
+		"                        \"auto\"matically when writing to a terminal",
+		"      --stats           report memory usage to stderr when done",
+		"  -h, --help            display this help and exit"
+	};
+	size_t i = 0;
+
+	fprintf(file, "Usage: %s [OPTIONS] [DIRECTORY]\n", argv0);
+	fprintf(file, "   or: %s --query=SOCKET [--format=F] QUERY\n", argv0);
+	for (; i < sizeof(lines) / sizeof(char *); i++) {
+		fprintf(file, "%s\n", lines[i]);
+	}
+}
+
+int main(int argc, char **argv) {
+	ckdu_tree tree;
+	ckdu_index pwd_index;
+	ckdu_staged_entry pwd_entry;
+	ckdu_inode_set inode_set;
+	ckdu_top_files top_files;
+	ckdu_output output;
+	const char *path = ".";
+	ckdu_options options;
+	sigset_t signals;
+	char const **boring_names = NULL;
+	char const *save_filename = NULL;
+	char const *load_filename = NULL;
+	char const *since_filename = NULL;
+	char const *diff_filename = NULL;
+	char const *listen_path = NULL;
+	char const *query_path = NULL;
+	ckdu_server server;
+	ckdu_tree previous_tree;
+	ckdu_index previous_root = CKDU_NO_INDEX;
+	char const *previous_path;
+	uint64_t settings;
+	bool has_previous = false;
+	int dir_fd = -1;
+	struct option const long_options[] = {
+		{"jobs", required_argument, NULL, 'j'},
+		{"max-depth", required_argument, NULL, 'd'},
+		{"summarize", no_argument, NULL, 's'},
+		{"dirs-only", no_argument, NULL, OPTION_DIRS_ONLY},
+		{"max-entries", required_argument, NULL, OPTION_MAX_ENTRIES},
+		{"threshold", required_argument, NULL, OPTION_THRESHOLD},
+		{"threshold-percent", required_argument, NULL, OPTION_THRESHOLD_PERCENT},
+		{"top", required_argument, NULL, OPTION_TOP},
+		{"engine", required_argument, NULL, OPTION_ENGINE},
+		{"queue-depth", required_argument, NULL, OPTION_QUEUE_DEPTH},
+		{"inode-order", no_argument, NULL, OPTION_INODE_ORDER},
+		{"allocated", no_argument, NULL, OPTION_ALLOCATED},
+		{"color", required_argument, NULL, OPTION_COLOR},
+		{"format", required_argument, NULL, OPTION_FORMAT},
+		{"stream", no_argument, NULL, OPTION_STREAM},
+		{"save", required_argument, NULL, OPTION_SAVE},
+		{"load", required_argument, NULL, OPTION_LOAD},
+		{"since", required_argument, NULL, OPTION_SINCE},
+		{"diff", required_argument, NULL, OPTION_DIFF},
+		{"daemon", no_argument, NULL, OPTION_DAEMON},
+		{"listen", required_argument, NULL, OPTION_LISTEN},
+		{"query", required_argument, NULL, OPTION_QUERY},
+		{"stats", no_argument, NULL, OPTION_STATS},
+		{"dont-sync", no_argument, NULL, OPTION_DONT_SYNC},
+		{"boring", required_argument, NULL, OPTION_BORING},
+		{"boring-names", required_argument, NULL, OPTION_BORING_NAMES},
+		{"help", no_argument, NULL, 'h'},
+		{NULL, 0, NULL, 0}
+	};
+	int c;
+
+	options.jobs = 1;
+	options.engine = CKDU_ENGINE_SYNC;
+	options.queue_depth = 64;
+	options.allocated_size = false;
+	options.dont_sync = false;
+	options.inode_order = false;
+	options.max_depth = UINT_MAX;
+	options.dirs_only = false;
+	options.max_entries = 0;
+	options.threshold = 0;
+	options.threshold_percent = 0.0;
+	options.top = 0;
+	options.boring_mode = CKDU_BORING_FULL;
+	options.boring_names = default_boring_names;
+	options.boring_name_count = sizeof(default_boring_names) / sizeof(char *);
+	options.color = isatty(STDOUT_FILENO);
+	options.format = CKDU_FORMAT_TREE;
+	options.stream = false;
+	options.daemon = false;
+	options.stamps = false;
+	options.print_stats = false;
+
+	while ((c = getopt_long(argc, argv, "j:d:sh", long_options, NULL)) != -1) {
+		switch (c) {
+		case 'j':
+			options.jobs = (unsigned int)atoi(optarg);
+			if (options.jobs < 1) {
+				fprintf(stderr, "Error: Invalid number of jobs \"%s\".\n", optarg);
+				return 1;
+			}
+			break;
+		case 'd':
+			{
+				char *end;
+				long const depth = strtol(optarg, &end, 10);
+				if (!*optarg || *end || (depth < 0) || (depth >= (long)UINT_MAX)) {
+					fprintf(stderr, "Error: Invalid depth \"%s\".\n", optarg);
+					return 1;
+				}
+				options.max_depth = (unsigned int)depth;
+			}
+			break;
+		case 's':
+			options.max_depth = 0;
+			break;
+		case OPTION_DIRS_ONLY:
+			options.dirs_only = true;
+			break;
+		case OPTION_MAX_ENTRIES:
+			options.max_entries = (unsigned int)atoi(optarg);
+			if (options.max_entries < 1) {
+				fprintf(stderr, "Error: Invalid number of entries \"%s\".\n", optarg);
+				return 1;
+			}
+			break;
+		case OPTION_THRESHOLD:
+			if (parse_size(optarg, &options.threshold)) {
+				fprintf(stderr, "Error: Invalid size \"%s\".\n", optarg);
+				return 1;
+			}
+			break;
+		case OPTION_THRESHOLD_PERCENT:
+			{
+				char *end;
+				options.threshold_percent = strtod(optarg, &end);
+				if (!*optarg || *end || !(options.threshold_percent >= 0.0)
+						|| (options.threshold_percent > 100.0)) {
+					fprintf(stderr, "Error: Invalid percentage \"%s\".\n", optarg);
+					return 1;
+				}
+			}
+			break;
+		case OPTION_TOP:
+			options.top = (unsigned int)atoi(optarg);
+			if (options.top < 1) {
+				fprintf(stderr, "Error: Invalid number of entries \"%s\".\n", optarg);
+				return 1;
+			}
+			break;
+		case OPTION_ENGINE:
+			if (!strcmp(optarg, "sync")) {
+				options.engine = CKDU_ENGINE_SYNC;
+			} else if (!strcmp(optarg, "uring")) {
+				options.engine = CKDU_ENGINE_URING;
+			} else {
+				fprintf(stderr, "Error: Unknown engine \"%s\".\n", optarg);
+				return 1;
+			}
+			break;
+		case OPTION_QUEUE_DEPTH:
+			options.queue_depth = (unsigned int)atoi(optarg);
+			if ((options.queue_depth < 2) || (options.queue_depth > 4096)) {
+				fprintf(stderr, "Error: Invalid queue depth \"%s\".\n", optarg);
+				return 1;
+			}
+			break;
+		case OPTION_INODE_ORDER:
+			options.inode_order = true;
+			break;
+		case OPTION_ALLOCATED:
+			options.allocated_size = true;
+			break;
+		case OPTION_DONT_SYNC:
+			options.dont_sync = true;
+			break;
+		case OPTION_BORING:
+			if (!strcmp(optarg, "full")) {
+				options.boring_mode = CKDU_BORING_FULL;
+			} else if (!strcmp(optarg, "shallow")) {
+				options.boring_mode = CKDU_BORING_SHALLOW;
+			} else if (!strcmp(optarg, "skip")) {
+				options.boring_mode = CKDU_BORING_SKIP;
+			} else {
+				fprintf(stderr, "Error: Unknown boring folder mode \"%s\".\n", optarg);
+				return 1;
+			}
+			break;
+		case OPTION_BORING_NAMES:
+			free(boring_names);
+			boring_names = malloc((split_names(optarg, NULL) + 1) * sizeof(char *));
+			if (!boring_names) {
+				handle_out_of_memory();
+			}
+			options.boring_names = boring_names;
+			options.boring_name_count = split_names(optarg, boring_names);
+			break;
+		case OPTION_COLOR:
+			if (!strcmp(optarg, "always")) {
+				options.color = true;
+			} else if (!strcmp(optarg, "never")) {
+				options.color = false;
+			} else if (!strcmp(optarg, "auto")) {
+				options.color = isatty(STDOUT_FILENO);
+			} else {
+				fprintf(stderr, "Error: Unknown color mode \"%s\".\n", optarg);
+				return 1;
+			}
+			break;
+		case OPTION_FORMAT:
+			if (parse_format(optarg, &options.format)) {
+				fprintf(stderr, "Error: Unknown format \"%s\".\n", optarg);
+				return 1;
+			}
+			break;
+		case OPTION_STREAM:
+			options.stream = true;
+			break;
+		case OPTION_SAVE:
+			save_filename = optarg;
+			break;
+		case OPTION_LOAD:
+			load_filename = optarg;
+			break;
+		case OPTION_SINCE:
+			since_filename = optarg;
+			break;
+		case OPTION_DIFF:
+			diff_filename = optarg;
+			break;
+		case OPTION_DAEMON:
+			options.daemon = true;
+			break;
+		case OPTION_LISTEN:
+			listen_path = optarg;
+			break;
+		case OPTION_QUERY:
+			query_path = optarg;
+			break;
+		case OPTION_STATS:
+			options.print_stats = true;
+			break;
+		case 'h':
+			print_usage(stdout, argv[0]);
+			return 0;
+		default:
+			print_usage(stderr, argv[0]);
+			return 1;
+		}
+	}
+	if (query_path) {
+		return run_query(query_path, argv + optind, argc - optind, &options);
+	}
+	if (optind < argc) {
+		path = argv[optind];
+	}
+	if (options.top && (options.format != CKDU_FORMAT_TREE)) {
+		fprintf(stderr, "Error: --top only comes as text.\n");
+		return 1;
+	}
+	if (options.stream && (options.top || (options.format != CKDU_FORMAT_TREE))) {
+		fprintf(stderr, "Error: --stream goes with neither --top nor --format.\n");
+		return 1;
+	}
+	if ((save_filename || load_filename || since_filename) && (options.top || options.stream)) {
+		fprintf(stderr, "Error: Snapshots go with neither --top nor --stream.\n");
+		return 1;
+	}
+	if (options.daemon && ((options.max_depth != UINT_MAX) || options.dirs_only || options.max_entries
+			|| options.threshold || options.top || options.stream || save_filename || load_filename
+			|| since_filename || (options.boring_mode != CKDU_BORING_FULL))) {
+		fprintf(stderr, "Error: --daemon keeps the whole tree, which rules out --max-depth, --summarize, "
+				"--dirs-only, --max-entries, --threshold, --top, --stream, snapshots and --boring.\n");
+		return 1;
+	}
+	if (listen_path && (options.top || options.stream)) {
+		fprintf(stderr, "Error: --listen goes with neither --top nor --stream.\n");
+		return 1;
+	}
+	if (diff_filename && (!load_filename || options.daemon || listen_path || options.top || options.stream
+			|| (options.format != CKDU_FORMAT_TREE))) {
+		fprintf(stderr, "Error: --diff compares two snapshots, the later one from --load, as text.\n");
+		return 1;
+	}
+	if (load_filename && since_filename) {
+		fprintf(stderr, "Error: --since goes with crawling, not with --load.\n");
+		return 1;
+	}
+	options.stamps = (save_filename || since_filename || options.daemon);
+	if (options.stream) {
+		/* Nothing below the starting point is kept */
+		options.max_depth = 0;
+		options.dirs_only = false;
+		options.max_entries = 0;
+		options.threshold = 0;
+		options.threshold_percent = 0.0;
+	}
+	if (options.top) {
+		/* Looks at everything, and only at the files themselves */
+		options.max_depth = UINT_MAX;
+		options.dirs_only = false;
+		options.max_entries = 0;
+		options.threshold = 0;
+		options.threshold_percent = 0.0;
+	}
+
+	if (options.daemon || listen_path) {
+		/* Taken through a signalfd later, all threads inherit the mask */
+		sigemptyset(&signals);
+		sigaddset(&signals, SIGUSR1);
+		sigaddset(&signals, SIGINT);
+		sigaddset(&signals, SIGTERM);
+		pthread_sigmask(SIG_BLOCK, &signals, NULL);
+	}
+
+	if (listen_path) {
+		errno = 0;
+		if (server_open(&server, listen_path)) {
+			fprintf(stderr, "Error: Cannot listen on \"%s\" (%s).\n", listen_path, strerror(errno));
+			return 1;
+		}
+	}
+
+	inode_set_init(&inode_set);
+	if (load_filename) {
+		errno = 0;
+		if (load_snapshot(&tree, load_filename, &pwd_index, &path, &settings)) {
+			fprintf(stderr, "Error: Cannot load snapshot \"%s\" (%s).\n", load_filename,
+					(errno == EINVAL) ? "not a sound snapshot of this version and byte order" : strerror(errno));
+			return 1;
+		}
+	} else {
+		errno = 0;
+		dir_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (dir_fd == -1) {
+			handle_opendir_error(errno, path);
+			return 1;
+		}
+
+		errno = 0;
+		if (fetch_metadata(&pwd_entry, dir_fd, ".", &options)) {
+			handle_stat_error(errno, path, ".");
+			return 1;
+		}
+		tree_init(&tree, options.dirs_only,
+				(options.max_entries || options.threshold || options.threshold_percent) && !options.dirs_only);
+		tree.root_fd = dir_fd;
+		pwd_index = plant_root(&tree, &pwd_entry);
+
+		if (since_filename) {
+			char const *problem = NULL;
+			errno = 0;
+			if (load_snapshot(&previous_tree, since_filename, &previous_root, &previous_path, &settings)) {
+				problem = (errno == EINVAL) ? "not a sound snapshot of this version and byte order" : strerror(errno);
+			} else {
+				if (settings != hash_tree_settings(&options)) {
+					problem = "taken with other options";
+				} else if ((previous_tree.devices[CKDU_AT(previous_tree.device, previous_root)] != pwd_entry.device)
+						|| (CKDU_AT(previous_tree.inode, previous_root) != pwd_entry.inode)) {
+					problem = "taken of another directory";
+				}
+				has_previous = !problem;
+				if (problem) {
+					tree_release(&previous_tree);
+				}
+			}
+			if (problem) {
+				fprintf(stderr, "Warning: Cannot use snapshot \"%s\" (%s), crawling everything.\n",
+						since_filename, problem);
+			}
+		}
+
+		if (options.top) {
+			top_files_init(&top_files, &tree, options.top);
+		}
+		crawl_tree(&tree, pwd_index, has_previous ? &previous_tree : NULL, previous_root,
+				&inode_set, options.top ? &top_files : NULL, dir_fd, path, &options);
+
+		/* Before saving, which may well replace that very file */
+		if (has_previous) {
+			tree_release(&previous_tree);
+		}
+	}
+
+	if (save_filename) {
+		errno = 0;
+		/* A snapshot loaded keeps the options it was taken with */
+		if (save_snapshot(&tree, pwd_index, path,
+				load_filename ? settings : hash_tree_settings(&options), save_filename)) {
+			fprintf(stderr, "Error: Cannot save snapshot \"%s\" (%s).\n", save_filename, strerror(errno));
+			return 1;
+		}
+	}
+
+	if (listen_path && !load_filename) {
+		server.real_root = realpath(path, NULL);
+	}
+
+	output_init(&output, STDOUT_FILENO, options.color);
+	if (options.stream) {
+		/* Written while crawling */
+	} else if (options.daemon) {
+		if (run_daemon(&tree, &pwd_index, &inode_set, dir_fd, path,
+				listen_path ? &server : NULL, &signals, &options)) {
+			return 1;
+		}
+	} else if (listen_path) {
+		if (run_server(&server, &tree, pwd_index, path, &signals, &options)) {
+			return 1;
+		}
+	} else if (options.top) {
+		present_top(&output, &tree, pwd_index, &top_files, path);
+		top_files_release(&top_files);
+	} else if (diff_filename) {
+		uint64_t previous_settings;
+
+		errno = 0;
+		if (load_snapshot(&previous_tree, diff_filename, &previous_root, &previous_path, &previous_settings)) {
+			fprintf(stderr, "Error: Cannot load snapshot \"%s\" (%s).\n", diff_filename,
+					(errno == EINVAL) ? "not a sound snapshot of this version and byte order" : strerror(errno));
+			return 1;
+		}
+		if (previous_settings != settings) {
+			fprintf(stderr, "Warning: Snapshots \"%s\" and \"%s\" were taken with different options, "
+					"so some of the changes may be down to that.\n", diff_filename, load_filename);
+		}
+		present_diff(&output, &previous_tree, previous_root, &tree, pwd_index, &options);
+		tree_release(&previous_tree);
+	} else {
+		present_formatted(&output, &tree, pwd_index, path, &options);
+	}
+	output_release(&output);
+	if (listen_path) {
+		server_close(&server);
+	}
+
+	if (options.print_stats) {
+		print_tree_stats(&tree);
+		print_inode_set_stats(&inode_set);
+	}
+
+	inode_set_release(&inode_set);
+	tree_release(&tree);
+	if (dir_fd != -1) {
+		close(dir_fd);
+	}
+	free(boring_names);
 	return 0;
 }